@@ -1,482 +1,2808 @@
+#define _GNU_SOURCE
 #include "my_malloc.h"
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <linux/rseq.h>
 
-static LinkList* HeadNode = NULL;
-static LinkList* TailNode = NULL;
-static unsigned long data_segment_size = 0;
-static unsigned long data_segment_free_space_size = 0;
-static size_t LLSIZE = sizeof(LinkList);
-pthread_mutex_t mutex;
-_Thread_local static LinkList* HeadNodeNoLock = NULL;
-_Thread_local static LinkList* TailNodeNoLock = NULL;
-
-void eraseNode(LinkList* currNode);
-void* deleteNode(LinkList* currNode);
-void* divide(LinkList* currNode, size_t size);
-void Traverse(LinkList* Node, int type);
-void insertNode(LinkList* Node, int type);
-void addNode(LinkList* Node);
-void conquer(LinkList* currNode);
-void conquerPrev(LinkList* currNode);
-void conquerNext(LinkList* currNode);
-void* deleteNodeNoLock(LinkList* currNode);
-void* divideNoLock(LinkList* currNode, size_t size);
-void TraverseNoLock(LinkList* Node, int type);
-void insertNodeNoLock(LinkList* Node, int type);
-void addNodeNoLock(LinkList* Node);
-void conquerNoLock(LinkList* currNode);
-void conquerPrevNoLock(LinkList* currNode);
-void conquerNextNoLock(LinkList* currNode);
+static Heap arenaHeaps[MAX_ARENAS];
+static Heap* heapTable[MAX_HEAPS]; // Indexed by LinkList heapId, arenas first
+static unsigned long heapCount = 0;
+static unsigned long arenaCount = 0;
+static unsigned long nextArena = 0;
+static int arenaPolicy = TS_ARENA_ROUND_ROBIN;
+static size_t LLSIZE = offsetof(LinkList, prevNode); // Header of every node
+static size_t MIN_PAYLOAD = sizeof(LinkList) - offsetof(LinkList, prevNode); // Room for the links
+static int mallocMode = TS_MODE_FIRST_FIT;
+static size_t tcacheMaxBytes = TCACHE_DEFAULT_BYTES;
+static size_t mmapThreshold = MMAP_THRESHOLD_DEFAULT;
+static int mmapThresholdFixed = 0;
+static size_t pageSize = 4096;
+static size_t growMin = GROW_MIN_DEFAULT;
+static size_t trimThreshold = TRIM_THRESHOLD_DEFAULT;
+static long purgeDecayMs = PURGE_DECAY_DEFAULT_MS;
+static char* slabBase = NULL; // Reserved slab region, set once under the mutex
+static size_t slabUsed = 0;
+static int slabFailed = 0;
+static unsigned int freeSlabs[SLAB_REGION_SIZE / SLAB_SIZE]; // Empty slab pages
+static size_t freeSlabCount = 0;
+static size_t SLAB_HEADER = (sizeof(Slab) + SLAB_STEP - 1) & ~(size_t)(SLAB_STEP - 1);
+static int centralEnabled = 1;
+static unsigned long centralHeads[SLAB_CLASSES]; // Tagged offsets of the top batches
+static unsigned long centralCounts[SLAB_CLASSES]; // Batches in each stack, approximate
+static int cpuCacheEnabled = 0;
+static CpuCache* cpuCaches = NULL; // CPU_CACHE_MAX_CPUS caches, mapped on first use
+static int lockKind = TS_LOCK_DEFAULT;
+static const char* lockNames[] = {"pthread", "ticket", "mcs", "adaptive"};
+static int spinYield = LOCK_SPIN_YIELD; // Spins between yields, 1 on a single CPU
+static int statsEnabled = 0;
+static const char* statsDump = NULL;
+static StatSlot statSlots[STAT_SLOTS];
+static MallocStats retiredStats; // Exited threads, under the mutex
+static int traceEnabled = 0;
+static int traceFd = -1;
+static long traceStart = 0;
+static unsigned long traceSeq = 0;
+static TraceBuffer* traceBuffers = NULL;
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER; // Keeps flushed buffers whole
+static pthread_key_t threadKey;
+static pthread_once_t threadOnce = PTHREAD_ONCE_INIT;
+static pthread_once_t initOnce = PTHREAD_ONCE_INIT;
+TsLock mutex = TS_LOCK_INITIALIZER; // Guards sbrk() and the heap table
+_Thread_local static Heap* NoLockHeap = NULL;
+_Thread_local static Heap* threadArena = NULL;
+_Thread_local static ThreadCache threadCache;
+_Thread_local static int threadRegistered = 0;
+_Thread_local static StatSlot* threadStats = NULL;
+_Thread_local static TraceBuffer* threadTrace = NULL;
+_Thread_local static int traceHold = 0; // Inside a call that records its own event
+_Thread_local static MCSNode mcsNodes[MCS_NODES];
+_Thread_local static struct rseq* threadRseq = NULL;
+_Thread_local static int rseqFailed = 0;
+_Thread_local static struct rseq rseqArea; // Registered here when the C library did not
+
+// Set by a C library that registers rseq for every thread (glibc 2.35+)
+extern const ptrdiff_t __rseq_offset __attribute__((weak));
+extern const unsigned int __rseq_size __attribute__((weak));
+
+// Counters are only written by their thread, readers may see them a little
+// late but never torn
+#define STAT_ADD(field, n) do { \
+        if (statsEnabled) { \
+            MallocStats* stats_ = getStats(); \
+            if (stats_ != NULL) { \
+                __atomic_store_n(&stats_->field, stats_->field + (n), __ATOMIC_RELAXED); \
+            } \
+        } \
+    } while (0)
+
+static size_t nodeSize(LinkList* Node);
+static unsigned long nodeHeapId(LinkList* Node);
+static void* nodeAddress(LinkList* Node);
+static void setNodeSize(LinkList* Node, size_t size);
+static void setFooter(LinkList* Node);
+static LinkList* prevPhysNode(LinkList* Node);
+static LinkList* nextPhysNode(LinkList* Node);
+static void* deleteNode(Heap* heap, LinkList* currNode);
+static void* divide(Heap* heap, LinkList* currNode, size_t size);
+static void addNode(Heap* heap, LinkList* Node);
+static void removeNode(Heap* heap, LinkList* Node);
+static LinkList* conquer(Heap* heap, LinkList* currNode);
+static void conquerPrev(Heap* heap, LinkList* currNode);
+static void conquerNext(Heap* heap, LinkList* currNode);
+static void mappingInsert(size_t size, int* fl, int* sl);
+static void insertBin(Heap* heap, LinkList* Node);
+static void removeBin(Heap* heap, LinkList* Node);
+static LinkList* findFirstFit(Heap* heap, size_t size);
+static LinkList* findSegregated(Heap* heap, size_t size);
+static void* extendHeap(Heap* heap, size_t size);
+static void* heapMalloc(Heap* heap, size_t size);
+static void* allocNode(Heap* heap, LinkList* currNode, size_t size);
+static void heapFree(Heap* heap, void* ptr);
+static void* tcacheMalloc(ThreadCache* tc, size_t size);
+static void tcacheFree(ThreadCache* tc, void* ptr, size_t size);
+static void tcacheRefill(ThreadCache* tc, int idx, size_t size);
+static void tcacheFlush(ThreadCache* tc, size_t target);
+static int tcacheFlushBatch(ThreadCache* tc, int idx);
+static void centralPush(int sizeClass, void* batch);
+static void* centralPop(int sizeClass);
+static void centralDrain(void);
+static int initCpuCaches(void);
+static struct rseq* getRseq(void);
+static void* cpuCachePop(struct rseq* rs, int idx);
+static int cpuCachePush(struct rseq* rs, int idx, void* ptr);
+static void* cpuCacheMalloc(size_t size);
+static int cpuCacheFree(void* ptr, size_t size);
+static void cpuCacheFlush(struct rseq* rs, int idx);
+static void cpuCacheDrain(void);
+static void cpuCacheDrainAll(void);
+static void initMalloc(void);
+static void* mmapNode(Heap* heap, size_t alignment, size_t size);
+static void* alignedMalloc(Heap* heap, size_t alignment, size_t size);
+static void splitTail(Heap* heap, LinkList* Node, size_t size);
+static int resizeNode(Heap* heap, LinkList* Node, size_t size);
+static void* remapNode(LinkList* Node, size_t size);
+static void clearBlock(void* ptr, size_t size);
+static void markUsed(Heap* heap, LinkList* Node);
+static int trimHeap(Heap* heap, size_t pad);
+static int purgeHeap(Heap* heap);
+static void decayHeap(Heap* heap);
+static long currentMs(void);
+static void munmapNode(LinkList* Node);
+static Heap* lockArena(void);
+static Heap* lockHeapArena(unsigned long heapId);
+static int isSlabObject(void* ptr);
+static Slab* slabOf(void* ptr);
+static Slab* newSlab(Heap* heap, int sizeClass);
+static void releaseSlab(Slab* slab);
+static void* slabMalloc(Heap* heap, size_t size);
+static void slabFree(Heap* heap, void* ptr);
+static unsigned long blockOwner(void* ptr);
+static size_t blockSize(void* ptr);
+static void* localMalloc(Heap* heap, size_t size);
+static void localFree(Heap* heap, void* ptr);
+static Heap* getNoLockHeap(void);
+static Heap* acquireHeap(void);
+static void remoteFree(Heap* heap, void* first, void* last);
+static size_t mallocBatchLock(size_t size, size_t n, void** out);
+static size_t mallocBatchNoLock(size_t size, size_t n, void** out);
+static size_t heapMallocBatch(Heap* heap, size_t size, size_t n, void** out);
+static void carveNode(LinkList* Node, size_t size, size_t count, void** out);
+static size_t sortBatch(void** ptrs, size_t n);
+static int compareAddress(const void* a, const void* b);
+static void freeBatchLock(void** ptrs, size_t n);
+static void freeBatchNoLock(void** ptrs, size_t n);
+static void localFreeSorted(Heap* heap, void** ptrs, size_t n);
+static void traceBatch(unsigned int op, void** ptrs, size_t n, size_t size);
+static void drainRemote(Heap* heap);
+static void registerThread(void);
+static void threadDestroy(void* arg);
+static void createThreadKey(void);
+static void* mallocLock(size_t size);
+static void freeLock(void* ptr);
+static void freeSizedLock(void* ptr, size_t size);
+static void* mallocNoLock(size_t size);
+static void freeNoLock(void* ptr);
+static void freeSizedNoLock(void* ptr, size_t size);
+static MallocStats* getStats(void);
+static void statMalloc(void* ptr);
+static void statFree(void* ptr);
+static void addStats(MallocStats* total, MallocStats* stats);
+static void initLock(TsLock* lock);
+static int trylockMutex(TsLock* lock);
+static void waitMutex(TsLock* lock);
+static void acquireMutex(TsLock* lock);
+static void lockMutex(TsLock* lock);
+static void unlockMutex(TsLock* lock);
+static MCSNode* takeMCSNode(void);
+static void spinPause(unsigned long* spins, unsigned long* sleeps);
+static void futexWait(int* addr, int value);
+static void futexWake(int* addr);
+static void addLockStats(LockStats* total, LockStats* stats);
+static long currentNs(void);
+static void* reallocLock(void* ptr, size_t size);
+static void* reallocNoLock(void* ptr, size_t size);
+static void openTrace(const char* path);
+static TraceBuffer* getTraceBuffer(void);
+static void traceRecord(unsigned int op, void* object, unsigned long arg, size_t size, unsigned long releaseSeq);
+static void* traceRealloc(void* (*resize)(void*, size_t), void* ptr, size_t size);
+static void traceFlush(TraceBuffer* buf);
+
+__attribute__((constructor)) static void initLibrary(void) {
+    pthread_once(&initOnce, initMalloc);
+}
+
+__attribute__((destructor)) static void finiLibrary(void) {
+    if (traceEnabled) {
+        // Threads still running lose the events they record from now on
+        traceEnabled = 0;
+        for (TraceBuffer* buf = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE); buf != NULL; buf = buf->next) {
+            traceFlush(buf);
+        }
+    }
+    if (statsDump == NULL) {
+        return;
+    }
+    FILE* out = stderr;
+    if (strcmp(statsDump, "stderr") != 0 && strcmp(statsDump, "-") != 0 && strcmp(statsDump, "1") != 0) {
+        out = fopen(statsDump, "a");
+        if (out == NULL) {
+            return;
+        }
+    }
+    ts_malloc_stats_print(out);
+    if (out != stderr) {
+        fclose(out);
+    }
+}
+
+static void initMalloc(void) {
+    // Read the environment and set up the arenas before the first malloc
+    const char* mode = getenv("TS_MALLOC_MODE");
+    if (mode != NULL) {
+        if (strcmp(mode, "segregated") == 0 || strcmp(mode, "tlsf") == 0) {
+            mallocMode = TS_MODE_SEGREGATED;
+        }
+        else if (strcmp(mode, "first-fit") == 0) {
+            mallocMode = TS_MODE_FIRST_FIT;
+        }
+    }
+    const char* tcacheBytes = getenv("TS_TCACHE_BYTES");
+    if (tcacheBytes != NULL) {
+        tcacheMaxBytes = strtoul(tcacheBytes, NULL, 0);
+    }
+    const char* central = getenv("TS_CENTRAL_POOL");
+    if (central != NULL) {
+        centralEnabled = (strtol(central, NULL, 0) != 0);
+    }
+    const char* cpuCache = getenv("TS_CPU_CACHE");
+    if (cpuCache != NULL && strtol(cpuCache, NULL, 0) != 0) {
+        cpuCacheEnabled = initCpuCaches();
+    }
+    const char* threshold = getenv("TS_MMAP_THRESHOLD");
+    if (threshold != NULL) {
+        mmapThreshold = strtoul(threshold, NULL, 0);
+        mmapThresholdFixed = 1;
+    }
+    const char* trim = getenv("TS_TRIM_THRESHOLD");
+    if (trim != NULL) {
+        trimThreshold = strtoul(trim, NULL, 0);
+    }
+    const char* decay = getenv("TS_PURGE_DECAY_MS");
+    if (decay != NULL) {
+        purgeDecayMs = strtol(decay, NULL, 0);
+    }
+    statsDump = getenv("TS_STATS_DUMP");
+    if (getenv("TS_STATS") != NULL || statsDump != NULL) {
+        statsEnabled = 1;
+    }
+    const char* trace = getenv("TS_TRACE");
+    if (trace != NULL) {
+        openTrace(trace);
+    }
+    const char* grow = getenv("TS_GROW_MIN");
+    if (grow != NULL) {
+        growMin = strtoul(grow, NULL, 0);
+    }
+    pageSize = sysconf(_SC_PAGESIZE);
+    // Locks are first taken after this, so the kind never changes under them
+    const char* lock = getenv("TS_LOCK");
+    for (int i = 0; lock != NULL && i < 4; i++) {
+        if (strcmp(lock, lockNames[i]) == 0) {
+            lockKind = i;
+        }
+    }
+    if (sysconf(_SC_NPROCESSORS_ONLN) == 1) {
+        spinYield = 1;
+    }
+    const char* arenas = getenv("TS_ARENAS");
+    long count = (arenas != NULL) ? strtol(arenas, NULL, 0) : sysconf(_SC_NPROCESSORS_ONLN);
+    count = (count < 1) ? 1 : (count > MAX_ARENAS) ? MAX_ARENAS : count;
+    const char* policy = getenv("TS_ARENA_POLICY");
+    if (policy != NULL && strcmp(policy, "cpu") == 0) {
+        arenaPolicy = TS_ARENA_CPU;
+    }
+    for (long i = 0; i < count; i++) {
+        initLock(&arenaHeaps[i].lock);
+        arenaHeaps[i].id = i;
+        arenaHeaps[i].owned = 1;
+        heapTable[i] = &arenaHeaps[i];
+    }
+    arenaCount = count;
+    heapCount = count;
+}
+
+int ts_mallopt(int param, int value) {
+    if (param == TS_M_MODE) {
+        if (value != TS_MODE_FIRST_FIT && value != TS_MODE_SEGREGATED) {
+            return 0;
+        }
+        // Both modes keep the list and the bins up to date, so the mode
+        // can be switched at any time
+        mallocMode = value;
+        return 1;
+    }
+    if (param == TS_M_TCACHE_BYTES) {
+        if (value < 0) {
+            return 0;
+        }
+        // Threads over the new cap shrink on their next free
+        tcacheMaxBytes = value;
+        return 1;
+    }
+    if (param == TS_M_MMAP_THRESHOLD) {
+        if (value < 0) {
+            return 0;
+        }
+        mmapThreshold = value;
+        mmapThresholdFixed = 1;
+        return 1;
+    }
+    if (param == TS_M_GROW_MIN) {
+        if (value < 0) {
+            return 0;
+        }
+        // Heaps that already grew past it keep their current chunk size
+        growMin = value;
+        return 1;
+    }
+    if (param == TS_M_TRIM_THRESHOLD) {
+        // A negative value turns automatic trimming off
+        trimThreshold = (value < 0) ? (size_t)-1 : (size_t)value;
+        return 1;
+    }
+    if (param == TS_M_PURGE_DECAY_MS) {
+        purgeDecayMs = value;
+        return 1;
+    }
+    if (param == TS_M_STATS) {
+        if (value != 0 && value != 1) {
+            return 0;
+        }
+        statsEnabled = value;
+        return 1;
+    }
+    if (param == TS_M_CENTRAL_POOL) {
+        if (value != 0 && value != 1) {
+            return 0;
+        }
+        centralEnabled = value;
+        if (value == 0) {
+            // Batches left in the pool would only be reachable from here
+            centralDrain();
+        }
+        return 1;
+    }
+    if (param == TS_M_CPU_CACHE) {
+        if (value != 0 && value != 1) {
+            return 0;
+        }
+        if (value == 0) {
+            __atomic_store_n(&cpuCacheEnabled, 0, __ATOMIC_RELEASE);
+            cpuCacheDrainAll();
+            return 1;
+        }
+        if (!initCpuCaches()) {
+            return 0;
+        }
+        __atomic_store_n(&cpuCacheEnabled, 1, __ATOMIC_RELEASE);
+        return 1;
+    }
+    return 0;
+}
 
 void* ts_malloc_lock(size_t size) {
+    void* res = mallocLock(size);
+    if (statsEnabled) {
+        statMalloc(res);
+    }
+    if (traceEnabled && res != NULL) {
+        traceRecord(TRACE_MALLOC, res, 0, size, 0);
+    }
+    return res;
+}
+
+void ts_free_lock(void* ptr) {
+    if (statsEnabled) {
+        statFree(ptr);
+    }
+    if (traceEnabled && ptr != NULL) {
+        traceRecord(TRACE_FREE, ptr, 0, 0, 0);
+    }
+    freeLock(ptr);
+}
+
+void ts_free_sized_lock(void* ptr, size_t size) {
+    if (statsEnabled) {
+        statFree(ptr);
+    }
+    if (traceEnabled && ptr != NULL) {
+        traceRecord(TRACE_FREE, ptr, 0, 0, 0);
+    }
+    freeSizedLock(ptr, size);
+}
+
+static void* mallocLock(size_t size) {
     if (size <= 0) {
         return NULL;
     }
-    pthread_mutex_lock(&mutex);
-    void* res = NULL;
-    LinkList* currNode = HeadNode; // Start find appropriate node to allocate memory
-    while (currNode != NULL) {
-        if (currNode->size < size) {
-            // No enough space, move to next node
-            currNode = currNode->nextNode;
+    if (size > SIZE_MAX / 2) { // Would wrap around when rounded up
+        errno = ENOMEM;
+        return NULL;
+    }
+    size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    if (size >= mmapThreshold) {
+        return mmapNode(NULL, ALIGN_SIZE, size);
+    }
+    if (size <= SLAB_MAX_SIZE && cpuCacheEnabled) {
+        void* res = cpuCacheMalloc(size);
+        if (res != NULL) {
+            return res;
+        }
+    }
+    if (size <= TCACHE_MAX_SIZE && tcacheMaxBytes > 0) {
+        return tcacheMalloc(&threadCache, size);
+    }
+    Heap* arena = lockArena();
+    void* res = localMalloc(arena, size);
+    unlockMutex(&arena->lock);
+    return res;
+}
+
+static void freeLock(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!isSlabObject(ptr) && (((LinkList*)(ptr - LLSIZE))->head & NODE_MMAPPED)) {
+        munmapNode(ptr - LLSIZE);
+        return;
+    }
+    size_t size = blockSize(ptr);
+    if (size <= SLAB_MAX_SIZE && cpuCacheEnabled && isSlabObject(ptr) && cpuCacheFree(ptr, size)) {
+        return;
+    }
+    if (size >= TCACHE_STEP && size <= TCACHE_MAX_SIZE && tcacheMaxBytes > 0) {
+        if (!isSlabObject(ptr)) {
+            ((LinkList*)(ptr - LLSIZE))->head &= ~NODE_FRESH;
+        }
+        tcacheFree(&threadCache, ptr, size);
+        return;
+    }
+    // Blocks go back to the arena they came from
+    Heap* arena = lockHeapArena(blockOwner(ptr));
+    localFree(arena, ptr);
+    unlockMutex(&arena->lock);
+}
+
+static void freeSizedLock(void* ptr, size_t size) {
+    // A slab object goes to the cache bin of the size it was asked for
+    // without reading its slab header: the object is at least that large,
+    // so it serves every request of the bin
+    size = (size == 0) ? ALIGN_SIZE : (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    assert(!isSlabObject(ptr) || size <= blockSize(ptr));
+    if (size <= SLAB_MAX_SIZE && cpuCacheEnabled && isSlabObject(ptr) && cpuCacheFree(ptr, size)) {
+        return;
+    }
+    if (size <= SLAB_MAX_SIZE && tcacheMaxBytes > 0 && isSlabObject(ptr)) {
+        tcacheFree(&threadCache, ptr, size);
+        return;
+    }
+    freeLock(ptr);
+}
+
+static void* localMalloc(Heap* heap, size_t size) {
+    // The caller owns the heap or holds its lock
+    void* res = NULL;
+    if (size <= SLAB_MAX_SIZE) {
+        res = slabMalloc(heap, size);
+        if (res != NULL) {
+            return res;
+        }
+    }
+    // A node has to hold the list links once it is freed
+    size = (size < MIN_PAYLOAD) ? MIN_PAYLOAD : size;
+    decayHeap(heap);
+    res = heapMalloc(heap, size);
+    if (res == NULL) { // There is no appropriate space, use sbrk() to allocate new space
+        res = extendHeap(heap, size);
+    }
+    return res;
+}
+
+static void localFree(Heap* heap, void* ptr) {
+    if (isSlabObject(ptr)) {
+        slabFree(heap, ptr);
+    }
+    else {
+        heapFree(heap, ptr);
+    }
+}
+
+static unsigned long blockOwner(void* ptr) {
+    return isSlabObject(ptr) ? slabOf(ptr)->heapId : nodeHeapId(ptr - LLSIZE);
+}
+
+static size_t blockSize(void* ptr) {
+    return isSlabObject(ptr) ? slabOf(ptr)->objectSize : nodeSize(ptr - LLSIZE);
+}
+
+static int isSlabObject(void* ptr) {
+    char* base = __atomic_load_n(&slabBase, __ATOMIC_RELAXED);
+    return base != NULL && (uintptr_t)((char*)ptr - base) < SLAB_REGION_SIZE;
+}
+
+static Slab* slabOf(void* ptr) {
+    return (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+static Slab* newSlab(Heap* heap, int sizeClass) {
+    // Reuse an empty slab page or carve a new one from the region, which is
+    // reserved on first use without committing memory
+    Slab* slab = NULL;
+    lockMutex(&mutex);
+    if (freeSlabCount > 0) {
+        slab = (Slab*)(slabBase + (size_t)freeSlabs[--freeSlabCount] * SLAB_SIZE);
+    }
+    else {
+        if (slabBase == NULL && !slabFailed) {
+            void* region = mmap(NULL, SLAB_REGION_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+            STAT_ADD(mmapCalls, 1);
+            if (region == MAP_FAILED) {
+                slabFailed = 1;
+            }
+            else {
+                __atomic_store_n(&slabBase, region, __ATOMIC_RELEASE);
+            }
+        }
+        if (slabBase != NULL && slabUsed + SLAB_SIZE <= SLAB_REGION_SIZE) {
+            slab = (Slab*)(slabBase + slabUsed);
+            slabUsed += SLAB_SIZE;
+        }
+    }
+    unlockMutex(&mutex);
+    if (slab == NULL) {
+        return NULL;
+    }
+    slab->heapId = heap->id;
+    slab->objectSize = (sizeClass + 1) * SLAB_STEP;
+    slab->capacity = (SLAB_SIZE - SLAB_HEADER) / slab->objectSize;
+    slab->freeCount = slab->capacity;
+    for (int i = 0; i < SLAB_BITMAP_WORDS; i++) {
+        unsigned int first = i * 64;
+        slab->bitmap[i] = (slab->capacity >= first + 64) ? ~0UL : (slab->capacity > first) ? (1UL << (slab->capacity - first)) - 1 : 0;
+    }
+    slab->prevSlab = NULL;
+    slab->nextSlab = heap->slabs[sizeClass];
+    if (slab->nextSlab != NULL) {
+        slab->nextSlab->prevSlab = slab;
+    }
+    heap->slabs[sizeClass] = slab;
+    return slab;
+}
+
+static void releaseSlab(Slab* slab) {
+    madvise(slab, SLAB_SIZE, MADV_DONTNEED);
+    lockMutex(&mutex);
+    freeSlabs[freeSlabCount++] = (unsigned int)(((char*)slab - slabBase) / SLAB_SIZE);
+    unlockMutex(&mutex);
+}
+
+static void* slabMalloc(Heap* heap, size_t size) {
+    int sizeClass = (int)((size - 1) / SLAB_STEP);
+    Slab* slab = heap->slabs[sizeClass];
+    if (slab == NULL) {
+        slab = newSlab(heap, sizeClass);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    // Take the first free object: a bit scan and a bit flip
+    int word = 0;
+    while (slab->bitmap[word] == 0) {
+        word++;
+    }
+    int bit = __builtin_ctzl(slab->bitmap[word]);
+    slab->bitmap[word] &= ~(1UL << bit);
+    if (--slab->freeCount == 0) {
+        // Full slabs leave the list until an object comes back
+        heap->slabs[sizeClass] = slab->nextSlab;
+        if (slab->nextSlab != NULL) {
+            slab->nextSlab->prevSlab = NULL;
+        }
+        slab->nextSlab = NULL;
+    }
+    return (char*)slab + SLAB_HEADER + (size_t)(word * 64 + bit) * slab->objectSize;
+}
+
+static void slabFree(Heap* heap, void* ptr) {
+    Slab* slab = slabOf(ptr);
+    int sizeClass = slab->objectSize / SLAB_STEP - 1;
+    size_t index = ((char*)ptr - (char*)slab - SLAB_HEADER) / slab->objectSize;
+    slab->bitmap[index / 64] |= 1UL << (index % 64);
+    slab->freeCount++;
+    if (slab->freeCount == 1) {
+        slab->prevSlab = NULL;
+        slab->nextSlab = heap->slabs[sizeClass];
+        if (slab->nextSlab != NULL) {
+            slab->nextSlab->prevSlab = slab;
+        }
+        heap->slabs[sizeClass] = slab;
+    }
+    else if (slab->freeCount == slab->capacity && (slab->prevSlab != NULL || slab->nextSlab != NULL)) {
+        // Empty slabs go back to the region unless it is the last one of
+        // the class, which avoids thrashing around an empty slab
+        if (slab->prevSlab != NULL) {
+            slab->prevSlab->nextSlab = slab->nextSlab;
+        }
+        else {
+            heap->slabs[sizeClass] = slab->nextSlab;
+        }
+        if (slab->nextSlab != NULL) {
+            slab->nextSlab->prevSlab = slab->prevSlab;
+        }
+        releaseSlab(slab);
+    }
+}
+
+static void* mmapNode(Heap* heap, size_t alignment, size_t size) {
+    // Large nodes get a mapping of their own that goes straight back to the
+    // kernel on free, instead of pinning part of the brk heap. prevSize
+    // holds the distance from the start of the mapping to the header.
+    size_t total = (size + LLSIZE + ((alignment > ALIGN_SIZE) ? alignment : 0) + pageSize - 1) & ~(pageSize - 1);
+    if (total < size) {
+        return NULL;
+    }
+    void* tmp = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    STAT_ADD(mmapCalls, 1);
+    if (tmp == MAP_FAILED) {
+        return NULL;
+    }
+    uintptr_t address = ((uintptr_t)tmp + LLSIZE + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    LinkList* Node = (void*)address - LLSIZE;
+    Node->prevSize = (void*)Node - tmp;
+    Node->head = ((heap != NULL) ? heap->id << HEAP_ID_SHIFT : 0) | (tmp + total - (void*)address) | NODE_MMAPPED;
+    return nodeAddress(Node);
+}
+
+static void munmapNode(LinkList* Node) {
+    size_t size = nodeSize(Node);
+    // Sliding threshold: a freed mapping of this size shows such requests
+    // come and go, so serve the next ones from the heap
+    if (!mmapThresholdFixed && size > mmapThreshold && size <= MMAP_THRESHOLD_MAX) {
+        mmapThreshold = size;
+    }
+    munmap((void*)Node - Node->prevSize, Node->prevSize + LLSIZE + size);
+    STAT_ADD(munmapCalls, 1);
+}
+
+void* ts_aligned_alloc_lock(size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGN_SIZE) {
+        return ts_malloc_lock(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    void* res = NULL;
+    if (size + alignment >= mmapThreshold) {
+        res = mmapNode(NULL, alignment, size);
+    }
+    else {
+        Heap* arena = lockArena();
+        res = alignedMalloc(arena, alignment, size);
+        unlockMutex(&arena->lock);
+    }
+    if (statsEnabled) {
+        statMalloc(res);
+    }
+    if (traceEnabled && res != NULL) {
+        traceRecord(TRACE_ALIGNED, res, alignment, size, 0);
+    }
+    return res;
+}
+
+int ts_posix_memalign_lock(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* res = ts_aligned_alloc_lock(alignment, size);
+    if (res == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = res;
+    return 0;
+}
+
+void* ts_aligned_alloc_nolock(size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= ALIGN_SIZE) {
+        return ts_malloc_nolock(size);
+    }
+    if (size == 0 || size > SIZE_MAX / 2 || alignment > SIZE_MAX / 4) {
+        return NULL;
+    }
+    Heap* heap = getNoLockHeap();
+    if (heap == NULL) {
+        return ts_aligned_alloc_lock(alignment, size);
+    }
+    size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    void* res = NULL;
+    if (size + alignment >= mmapThreshold) {
+        res = mmapNode(heap, alignment, size);
+    }
+    else {
+        if (__atomic_load_n(&heap->remoteHead, __ATOMIC_RELAXED) != NULL) {
+            drainRemote(heap);
+        }
+        res = alignedMalloc(heap, alignment, size);
+    }
+    if (statsEnabled) {
+        statMalloc(res);
+    }
+    if (traceEnabled && res != NULL) {
+        traceRecord(TRACE_ALIGNED, res, alignment, size, 0);
+    }
+    return res;
+}
+
+int ts_posix_memalign_nolock(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void* res = ts_aligned_alloc_nolock(alignment, size);
+    if (res == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = res;
+    return 0;
+}
+
+static void* alignedMalloc(Heap* heap, size_t alignment, size_t size) {
+    // Take a node with room for the alignment gap plus a free node in front
+    // of it, then give back the gap and the tail. Slabs are skipped, their
+    // objects are only ALIGN_SIZE aligned. Blocks aligned to a cache line
+    // or more also end on their alignment, so the header of the tail does
+    // not share their last line.
+    size = (size < MIN_PAYLOAD) ? MIN_PAYLOAD : size;
+    if (alignment >= CACHE_LINE_SIZE) {
+        size = (size + alignment - 1) & ~(size_t)(alignment - 1);
+    }
+    size_t need = size + alignment + LLSIZE + MIN_PAYLOAD;
+    void* ptr = heapMalloc(heap, need);
+    if (ptr == NULL) {
+        ptr = extendHeap(heap, need);
+        if (ptr == NULL) {
+            return NULL;
+        }
+    }
+    LinkList* Node = ptr - LLSIZE;
+    uintptr_t address = ((uintptr_t)ptr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+    if (address != (uintptr_t)ptr) {
+        if (address - (uintptr_t)ptr < LLSIZE + MIN_PAYLOAD) {
+            address += alignment;
+        }
+        LinkList* alignedNode = (void*)address - LLSIZE;
+        size_t lead = (void*)alignedNode - (void*)Node;
+        alignedNode->head = (heap->id << HEAP_ID_SHIFT) | (nodeSize(Node) - lead);
+        setNodeSize(Node, lead - LLSIZE);
+        heapFree(heap, ptr);
+        Node = alignedNode;
+    }
+    splitTail(heap, Node, size);
+    return nodeAddress(Node);
+}
+
+static void splitTail(Heap* heap, LinkList* Node, size_t size) {
+    // Give the end of an allocated node past size back to the heap
+    if (nodeSize(Node) >= size + LLSIZE + MIN_PAYLOAD) {
+        LinkList* tailNode = nodeAddress(Node) + size;
+        tailNode->head = (heap->id << HEAP_ID_SHIFT) | (nodeSize(Node) - size - LLSIZE);
+        setNodeSize(Node, size);
+        heapFree(heap, nodeAddress(tailNode));
+    }
+}
+
+static int resizeNode(Heap* heap, LinkList* Node, size_t size) {
+    // Resize an allocated node in place, growing it into a free next
+    // neighbour. Returns 0 when the neighbour is too small.
+    size = (size < MIN_PAYLOAD) ? MIN_PAYLOAD : size;
+    if (nodeSize(Node) < size) {
+        LinkList* nextNode = nextPhysNode(Node);
+        if (nextNode == NULL || nodeSize(Node) + LLSIZE + nodeSize(nextNode) < size) {
+            return 0;
+        }
+        removeNode(heap, nextNode);
+        heap->freeSpaceSize -= nodeSize(nextNode) + LLSIZE;
+        setNodeSize(Node, nodeSize(Node) + LLSIZE + nodeSize(nextNode));
+        setFooter(Node);
+        markUsed(heap, Node);
+    }
+    splitTail(heap, Node, size);
+    return 1;
+}
+
+static void* remapNode(LinkList* Node, size_t size) {
+    // Let the kernel move the pages of a mapped node instead of copying
+    size_t offset = Node->prevSize;
+    size_t oldTotal = offset + LLSIZE + nodeSize(Node);
+    size_t total = (offset + LLSIZE + size + pageSize - 1) & ~(pageSize - 1);
+    if (total < size) {
+        return NULL;
+    }
+    if (total != oldTotal) {
+        void* tmp = mremap((void*)Node - offset, oldTotal, total, MREMAP_MAYMOVE);
+        STAT_ADD(mmapCalls, 1);
+        if (tmp == MAP_FAILED) {
+            return NULL;
+        }
+        Node = tmp + offset;
+        setNodeSize(Node, total - offset - LLSIZE);
+    }
+    return nodeAddress(Node);
+}
+
+void* ts_realloc_lock(void* ptr, size_t size) {
+    return traceEnabled ? traceRealloc(reallocLock, ptr, size) : reallocLock(ptr, size);
+}
+
+void* ts_realloc_nolock(void* ptr, size_t size) {
+    return traceEnabled ? traceRealloc(reallocNoLock, ptr, size) : reallocNoLock(ptr, size);
+}
+
+static void* reallocLock(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return ts_malloc_lock(size);
+    }
+    if (size == 0) {
+        ts_free_lock(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t request = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    size_t oldSize = blockSize(ptr);
+    if (isSlabObject(ptr)) {
+        if (request <= oldSize) {
+            return ptr;
+        }
+    }
+    else if (((LinkList*)(ptr - LLSIZE))->head & NODE_MMAPPED) {
+        void* res = remapNode(ptr - LLSIZE, request);
+        if (res != NULL) {
+            STAT_ADD(freedBytes, oldSize);
+            STAT_ADD(allocatedBytes, blockSize(res));
+            return res;
+        }
+    }
+    else {
+        Heap* arena = lockHeapArena(nodeHeapId(ptr - LLSIZE));
+        int resized = resizeNode(arena, ptr - LLSIZE, request);
+        unlockMutex(&arena->lock);
+        if (resized) {
+            STAT_ADD(freedBytes, oldSize);
+            STAT_ADD(allocatedBytes, blockSize(ptr));
+            return ptr;
+        }
+    }
+    void* res = ts_malloc_lock(size);
+    if (res != NULL) {
+        memcpy(res, ptr, (oldSize < size) ? oldSize : size);
+        ts_free_lock(ptr);
+    }
+    return res;
+}
+
+static void* reallocNoLock(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return ts_malloc_nolock(size);
+    }
+    if (size == 0) {
+        ts_free_nolock(ptr);
+        return NULL;
+    }
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t request = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    size_t oldSize = blockSize(ptr);
+    if (isSlabObject(ptr)) {
+        if (request <= oldSize) {
+            return ptr;
+        }
+    }
+    else if (((LinkList*)(ptr - LLSIZE))->head & NODE_MMAPPED) {
+        void* res = remapNode(ptr - LLSIZE, request);
+        if (res != NULL) {
+            STAT_ADD(freedBytes, oldSize);
+            STAT_ADD(allocatedBytes, blockSize(res));
+            return res;
+        }
+    }
+    else if (nodeHeapId(ptr - LLSIZE) < arenaCount) {
+        return reallocLock(ptr, size);
+    }
+    else if (NoLockHeap != NULL && nodeHeapId(ptr - LLSIZE) == NoLockHeap->id) {
+        // Nodes of other threads' heaps are only moved, never resized
+        if (resizeNode(NoLockHeap, ptr - LLSIZE, request)) {
+            STAT_ADD(freedBytes, oldSize);
+            STAT_ADD(allocatedBytes, blockSize(ptr));
+            return ptr;
+        }
+    }
+    void* res = ts_malloc_nolock(size);
+    if (res != NULL) {
+        memcpy(res, ptr, (oldSize < size) ? oldSize : size);
+        ts_free_nolock(ptr);
+    }
+    return res;
+}
+
+void* ts_calloc_lock(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / 2 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* ptr = ts_malloc_lock(nmemb * size);
+    clearBlock(ptr, nmemb * size);
+    return ptr;
+}
+
+void* ts_calloc_nolock(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / 2 / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    void* ptr = ts_malloc_nolock(nmemb * size);
+    clearBlock(ptr, nmemb * size);
+    return ptr;
+}
+
+static void clearBlock(void* ptr, size_t size) {
+    // Mappings are zero, and so is a fresh node apart from the links it
+    // held while it was free
+    if (ptr == NULL) {
+        return;
+    }
+    if (!isSlabObject(ptr)) {
+        LinkList* Node = ptr - LLSIZE;
+        if (Node->head & NODE_MMAPPED) {
+            return;
+        }
+        if ((Node->head & NODE_FRESH) && size > MIN_PAYLOAD) {
+            size = MIN_PAYLOAD;
+        }
+    }
+    memset(ptr, 0, size);
+}
+
+size_t ts_malloc_batch_lock(size_t size, size_t n, void** out) {
+    size_t done = mallocBatchLock(size, n, out);
+    if (statsEnabled) {
+        for (size_t i = 0; i < done; i++) {
+            statMalloc(out[i]);
+        }
+    }
+    if (traceEnabled) {
+        traceBatch(TRACE_MALLOC, out, done, size);
+    }
+    return done;
+}
+
+size_t ts_malloc_batch_nolock(size_t size, size_t n, void** out) {
+    size_t done = mallocBatchNoLock(size, n, out);
+    if (statsEnabled) {
+        for (size_t i = 0; i < done; i++) {
+            statMalloc(out[i]);
+        }
+    }
+    if (traceEnabled) {
+        traceBatch(TRACE_MALLOC, out, done, size);
+    }
+    return done;
+}
+
+void ts_free_batch_lock(void** ptrs, size_t n) {
+    if (statsEnabled) {
+        for (size_t i = 0; i < n; i++) {
+            statFree(ptrs[i]);
+        }
+    }
+    if (traceEnabled) {
+        traceBatch(TRACE_FREE, ptrs, n, 0);
+    }
+    freeBatchLock(ptrs, n);
+}
+
+void ts_free_batch_nolock(void** ptrs, size_t n) {
+    if (statsEnabled) {
+        for (size_t i = 0; i < n; i++) {
+            statFree(ptrs[i]);
+        }
+    }
+    if (traceEnabled) {
+        traceBatch(TRACE_FREE, ptrs, n, 0);
+    }
+    freeBatchNoLock(ptrs, n);
+}
+
+static size_t mallocBatchLock(size_t size, size_t n, void** out) {
+    size_t done = 0;
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+    }
+    else if (size > 0) {
+        size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+        if (size >= mmapThreshold) {
+            while (done < n && (out[done] = mmapNode(NULL, ALIGN_SIZE, size)) != NULL) {
+                done++;
+            }
+        }
+        else if (n > 0) {
+            Heap* arena = lockArena();
+            done = heapMallocBatch(arena, size, n, out);
+            unlockMutex(&arena->lock);
+        }
+    }
+    for (size_t i = done; i < n; i++) {
+        out[i] = NULL;
+    }
+    return done;
+}
+
+static size_t mallocBatchNoLock(size_t size, size_t n, void** out) {
+    if (size <= 0 || size > SIZE_MAX / 2 || n == 0) {
+        return mallocBatchLock(size, n, out);
+    }
+    Heap* heap = getNoLockHeap();
+    if (heap == NULL) { // The heap table is full, share the locked heap
+        return mallocBatchLock(size, n, out);
+    }
+    size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    if (size >= mmapThreshold) {
+        size_t done = 0;
+        while (done < n && (out[done] = mmapNode(heap, ALIGN_SIZE, size)) != NULL) {
+            done++;
+        }
+        for (size_t i = done; i < n; i++) {
+            out[i] = NULL;
+        }
+        return done;
+    }
+    if (__atomic_load_n(&heap->remoteHead, __ATOMIC_RELAXED) != NULL) {
+        drainRemote(heap);
+    }
+    size_t done = heapMallocBatch(heap, size, n, out);
+    for (size_t i = done; i < n; i++) {
+        out[i] = NULL;
+    }
+    return done;
+}
+
+static size_t heapMallocBatch(Heap* heap, size_t size, size_t n, void** out) {
+    // The caller owns the heap or holds its lock. Slab objects are taken
+    // one by one, larger blocks are carved out of a single free node or
+    // sbrk() extension per BATCH_CARVE_BYTES.
+    size_t done = 0;
+    if (size <= SLAB_MAX_SIZE) {
+        while (done < n && (out[done] = slabMalloc(heap, size)) != NULL) {
+            done++;
+        }
+    }
+    size = (size < MIN_PAYLOAD) ? MIN_PAYLOAD : size;
+    size_t perNode = BATCH_CARVE_BYTES / (size + LLSIZE);
+    perNode = (perNode < 1) ? 1 : perNode;
+    while (done < n) {
+        size_t count = (n - done < perNode) ? n - done : perNode;
+        size_t total = count * (size + LLSIZE) - LLSIZE;
+        void* ptr = heapMalloc(heap, total);
+        if (ptr == NULL) {
+            ptr = extendHeap(heap, total);
+            if (ptr == NULL) {
+                break;
+            }
+        }
+        carveNode(ptr - LLSIZE, size, count, out + done);
+        done += count;
+    }
+    return done;
+}
+
+static void carveNode(LinkList* Node, size_t size, size_t count, void** out) {
+    // Split an allocated node into count allocated nodes of size bytes, the
+    // last one keeps whatever is left. The new headers lie in the payload,
+    // so a fresh node gives fresh nodes.
+    unsigned long head = Node->head & ~(NODE_SIZE_MASK | NODE_PREV_FREE);
+    size_t rest = nodeSize(Node);
+    for (size_t i = 0; i + 1 < count; i++) {
+        setNodeSize(Node, size);
+        out[i] = nodeAddress(Node);
+        rest -= size + LLSIZE;
+        Node = nodeAddress(Node) + size;
+        Node->head = head | rest;
+    }
+    out[count - 1] = nodeAddress(Node);
+}
+
+static size_t sortBatch(void** ptrs, size_t n) {
+    // Sort by address and unmap the blocks with mappings of their own.
+    // Returns how many blocks are left, moved to the front of the array.
+    qsort(ptrs, n, sizeof(void*), compareAddress);
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        void* ptr = ptrs[i];
+        if (ptr == NULL) {
+            continue;
+        }
+        if (!isSlabObject(ptr) && (((LinkList*)(ptr - LLSIZE))->head & NODE_MMAPPED)) {
+            munmapNode(ptr - LLSIZE);
+            continue;
+        }
+        ptrs[kept++] = ptr;
+    }
+    return kept;
+}
+
+static int compareAddress(const void* a, const void* b) {
+    uintptr_t x = (uintptr_t)*(void* const*)a;
+    uintptr_t y = (uintptr_t)*(void* const*)b;
+    return (x > y) - (x < y);
+}
+
+static void freeBatchLock(void** ptrs, size_t n) {
+    // Each run of blocks of one arena is freed under one lock acquisition
+    n = sortBatch(ptrs, n);
+    size_t start = 0;
+    while (start < n) {
+        unsigned long owner = blockOwner(ptrs[start]);
+        size_t end = start + 1;
+        while (end < n && blockOwner(ptrs[end]) == owner) {
+            end++;
+        }
+        Heap* arena = lockHeapArena(owner);
+        localFreeSorted(arena, ptrs + start, end - start);
+        unlockMutex(&arena->lock);
+        start = end;
+    }
+}
+
+static void freeBatchNoLock(void** ptrs, size_t n) {
+    // Runs of the own heap are freed directly, runs of arenas under their
+    // lock and runs of other threads' heaps are pushed with one CAS
+    n = sortBatch(ptrs, n);
+    Heap* heap = NoLockHeap;
+    size_t start = 0;
+    while (start < n) {
+        unsigned long owner = blockOwner(ptrs[start]);
+        size_t end = start + 1;
+        while (end < n && blockOwner(ptrs[end]) == owner) {
+            end++;
+        }
+        if (heap != NULL && owner == heap->id) {
+            localFreeSorted(heap, ptrs + start, end - start);
+        }
+        else if (owner < arenaCount) {
+            Heap* arena = lockHeapArena(owner);
+            localFreeSorted(arena, ptrs + start, end - start);
+            unlockMutex(&arena->lock);
+        }
+        else {
+            for (size_t i = start; i + 1 < end; i++) {
+                *(void**)ptrs[i] = ptrs[i + 1];
+            }
+            remoteFree(heapTable[owner], ptrs[start], ptrs[end - 1]);
+        }
+        start = end;
+    }
+}
+
+static void localFreeSorted(Heap* heap, void** ptrs, size_t n) {
+    // Blocks sorted by address. Physically adjacent nodes are merged first,
+    // so a run of neighbours is freed and coalesced as one node.
+    size_t i = 0;
+    while (i < n) {
+        void* ptr = ptrs[i++];
+        if (isSlabObject(ptr)) {
+            slabFree(heap, ptr);
+            continue;
+        }
+        LinkList* Node = ptr - LLSIZE;
+        while (i < n && !isSlabObject(ptrs[i]) && ptrs[i] == nodeAddress(Node) + nodeSize(Node) + LLSIZE) {
+            setNodeSize(Node, nodeSize(Node) + LLSIZE + nodeSize(ptrs[i] - LLSIZE));
+            i++;
+        }
+        heapFree(heap, ptr);
+    }
+}
+
+static void traceBatch(unsigned int op, void** ptrs, size_t n, size_t size) {
+    // One event per block, as if each was allocated or freed on its own
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            traceRecord(op, ptrs[i], 0, size, 0);
+        }
+    }
+}
+
+static Heap* lockArena(void) {
+    // Lock the arena of the calling thread. When it is busy try the others
+    // and, with round-robin binding, stay on the one that was free.
+    if (threadArena == NULL) {
+        pthread_once(&initOnce, initMalloc);
+        threadArena = heapTable[__atomic_fetch_add(&nextArena, 1, __ATOMIC_RELAXED) % arenaCount];
+    }
+    Heap* arena = threadArena;
+    if (arenaPolicy == TS_ARENA_CPU) {
+        int cpu = sched_getcpu();
+        arena = heapTable[(cpu < 0) ? 0 : cpu % arenaCount];
+    }
+    if (trylockMutex(&arena->lock)) {
+        arena->mallocCount++;
+        STAT_ADD(lockAcquired, 1);
+        return arena;
+    }
+    __atomic_fetch_add(&arena->contendedCount, 1, __ATOMIC_RELAXED);
+    for (unsigned long i = 1; i < arenaCount; i++) {
+        Heap* other = heapTable[(arena->id + i) % arenaCount];
+        if (trylockMutex(&other->lock)) {
+            if (arenaPolicy == TS_ARENA_ROUND_ROBIN) {
+                threadArena = other;
+            }
+            other->mallocCount++;
+            STAT_ADD(lockAcquired, 1);
+            return other;
+        }
+    }
+    lockMutex(&arena->lock);
+    arena->mallocCount++;
+    return arena;
+}
+
+static Heap* lockHeapArena(unsigned long heapId) {
+    Heap* arena = heapTable[heapId];
+    lockMutex(&arena->lock);
+    arena->freeCount++;
+    return arena;
+}
+
+void* ts_malloc_nolock(size_t size) {
+    void* res = mallocNoLock(size);
+    if (statsEnabled) {
+        statMalloc(res);
+    }
+    if (traceEnabled && res != NULL) {
+        traceRecord(TRACE_MALLOC, res, 0, size, 0);
+    }
+    return res;
+}
+
+void ts_free_nolock(void* ptr) {
+    if (statsEnabled) {
+        statFree(ptr);
+    }
+    if (traceEnabled && ptr != NULL) {
+        traceRecord(TRACE_FREE, ptr, 0, 0, 0);
+    }
+    freeNoLock(ptr);
+}
+
+void ts_free_sized_nolock(void* ptr, size_t size) {
+    if (statsEnabled) {
+        statFree(ptr);
+    }
+    if (traceEnabled && ptr != NULL) {
+        traceRecord(TRACE_FREE, ptr, 0, 0, 0);
+    }
+    freeSizedNoLock(ptr, size);
+}
+
+static void* mallocNoLock(size_t size) {
+    if (size <= 0) {
+        return NULL;
+    }
+    if (size > SIZE_MAX / 2) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    Heap* heap = getNoLockHeap();
+    if (heap == NULL) { // The heap table is full, share the locked heap
+        return mallocLock(size);
+    }
+    size = (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    if (size >= mmapThreshold) {
+        return mmapNode(heap, ALIGN_SIZE, size);
+    }
+    if (__atomic_load_n(&heap->remoteHead, __ATOMIC_RELAXED) != NULL) {
+        drainRemote(heap);
+    }
+    // Only sbrk() and the slab region are shared between threads
+    return localMalloc(heap, size);
+}
+
+static void freeNoLock(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!isSlabObject(ptr) && (((LinkList*)(ptr - LLSIZE))->head & NODE_MMAPPED)) {
+        munmapNode(ptr - LLSIZE);
+        return;
+    }
+    unsigned long owner = blockOwner(ptr);
+    Heap* heap = NoLockHeap;
+    if (heap != NULL && owner == heap->id) {
+        localFree(heap, ptr);
+        return;
+    }
+    if (owner < arenaCount) {
+        freeLock(ptr);
+        return;
+    }
+    // Blocks of other threads go back to their owner
+    remoteFree(heapTable[owner], ptr, ptr);
+}
+
+static void freeSizedNoLock(void* ptr, size_t size) {
+    // A small size and an address in the slab region make a slab object, so
+    // the mapping check is skipped. Its owner is only known from the slab
+    // header, and the free of an own object updates that header anyway.
+    // Other blocks need their node header and take the freeNoLock() path.
+    size = (size == 0) ? ALIGN_SIZE : (size + ALIGN_SIZE - 1) & ~(size_t)(ALIGN_SIZE - 1);
+    assert(!isSlabObject(ptr) || size <= blockSize(ptr));
+    if (size <= SLAB_MAX_SIZE && isSlabObject(ptr)) {
+        Slab* slab = slabOf(ptr);
+        Heap* heap = NoLockHeap;
+        if (heap != NULL && slab->heapId == heap->id) {
+            slabFree(heap, ptr);
+            return;
+        }
+        if (slab->heapId < arenaCount) {
+            freeSizedLock(ptr, size);
+            return;
+        }
+        remoteFree(heapTable[slab->heapId], ptr, ptr);
+        return;
+    }
+    freeNoLock(ptr);
+}
+
+static Heap* getNoLockHeap(void) {
+    if (NoLockHeap == NULL) {
+        NoLockHeap = acquireHeap();
+        registerThread();
+    }
+    return NoLockHeap;
+}
+
+static Heap* acquireHeap(void) {
+    // Adopt the heap of an exited thread, with its free nodes and pending
+    // remote frees, before creating a new one
+    pthread_once(&initOnce, initMalloc);
+    unsigned long count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    for (unsigned long i = arenaCount; i < count; i++) {
+        int owned = 0;
+        if (__atomic_compare_exchange_n(&heapTable[i]->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            return heapTable[i];
+        }
+    }
+    Heap* heap = NULL;
+    lockMutex(&mutex);
+    if (heapCount < MAX_HEAPS) {
+        heap = mmap(NULL, sizeof(Heap), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        STAT_ADD(mmapCalls, 1);
+        if (heap == MAP_FAILED) {
+            heap = NULL;
+        }
+        else {
+            heap->id = heapCount;
+            heap->owned = 1;
+            heapTable[heapCount] = heap;
+            __atomic_store_n(&heapCount, heapCount + 1, __ATOMIC_RELEASE);
+        }
+    }
+    unlockMutex(&mutex);
+    return heap;
+}
+
+static void remoteFree(Heap* heap, void* first, void* last) {
+    // Push a chain of blocks from first to last with a single CAS, the
+    // owner takes the whole stack at once so there is no ABA problem
+    void* head = __atomic_load_n(&heap->remoteHead, __ATOMIC_RELAXED);
+    do {
+        *(void**)last = head;
+    } while (!__atomic_compare_exchange_n(&heap->remoteHead, &head, first, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+static void drainRemote(Heap* heap) {
+    void* ptr = __atomic_exchange_n(&heap->remoteHead, NULL, __ATOMIC_ACQUIRE);
+    while (ptr != NULL) {
+        void* next = *(void**)ptr;
+        localFree(heap, ptr);
+        ptr = next;
+    }
+}
+
+static void registerThread(void) {
+    // Get a destructor call at thread exit
+    if (!threadRegistered) {
+        // Set first, pthread_setspecific() may call malloc for high keys
+        threadRegistered = 1;
+        pthread_once(&threadOnce, createThreadKey);
+        pthread_setspecific(threadKey, &threadCache);
+    }
+}
+
+static void threadDestroy(void* arg) {
+    (void)arg;
+    tcacheFlush(&threadCache, 0);
+    if (threadTrace != NULL) {
+        traceFlush(threadTrace);
+        __atomic_store_n(&threadTrace->inUse, 0, __ATOMIC_RELEASE);
+        threadTrace = NULL;
+    }
+    if (threadStats != NULL) {
+        // Fold the counters into the exited threads' total and free the slot
+        acquireMutex(&mutex);
+        addStats(&retiredStats, &threadStats->stats);
+        unlockMutex(&mutex);
+        memset(&threadStats->stats, 0, sizeof(MallocStats));
+        __atomic_store_n(&threadStats->inUse, 0, __ATOMIC_RELEASE);
+        threadStats = NULL;
+    }
+    if (NoLockHeap != NULL) {
+        __atomic_store_n(&NoLockHeap->owned, 0, __ATOMIC_RELEASE);
+        NoLockHeap = NULL;
+    }
+    threadRegistered = 0;
+}
+
+static void createThreadKey(void) {
+    pthread_key_create(&threadKey, threadDestroy);
+}
+
+static void* tcacheMalloc(ThreadCache* tc, size_t size) {
+    // Requests are rounded up to the bin size, so any cached block fits
+    int idx = (int)((size - 1) / TCACHE_STEP);
+    if (tc->bins[idx] == NULL) {
+        tcacheRefill(tc, idx, (size_t)(idx + 1) * TCACHE_STEP);
+        if (tc->bins[idx] == NULL) {
+            return NULL;
+        }
+    }
+    void* ptr = tc->bins[idx];
+    tc->bins[idx] = *(void**)ptr;
+    tc->counts[idx]--;
+    tc->bytes -= (size_t)(idx + 1) * TCACHE_STEP;
+    return ptr;
+}
+
+static void tcacheFree(ThreadCache* tc, void* ptr, size_t size) {
+    // A block of at least (idx + 1) * TCACHE_STEP bytes serves bin idx
+    int idx = (int)(size / TCACHE_STEP) - 1;
+    size_t binSize = (size_t)(idx + 1) * TCACHE_STEP;
+    if (tc->bytes + binSize > tcacheMaxBytes) {
+        tcacheFlush(tc, tcacheMaxBytes / 2);
+        if (tc->bytes + binSize > tcacheMaxBytes) {
+            Heap* arena = lockHeapArena(blockOwner(ptr));
+            localFree(arena, ptr);
+            unlockMutex(&arena->lock);
+            return;
+        }
+    }
+    *(void**)ptr = tc->bins[idx];
+    tc->bins[idx] = ptr;
+    tc->counts[idx]++;
+    tc->bytes += binSize;
+}
+
+static void tcacheRefill(ThreadCache* tc, int idx, size_t size) {
+    registerThread();
+    // Take a batch of blocks under one lock acquisition, staying under the
+    // cap (the block handed out right away does not count)
+    size_t room = (tc->bytes < tcacheMaxBytes) ? (tcacheMaxBytes - tc->bytes) / size : 0;
+    size_t fill = TCACHE_FILL_BYTES / size;
+    fill = (fill < 2) ? 2 : (fill > TCACHE_FILL) ? TCACHE_FILL : fill;
+    int count = (room + 1 < fill) ? (int)room + 1 : (int)fill;
+    if (centralEnabled && size <= SLAB_MAX_SIZE && count == CENTRAL_BATCH) {
+        // The bin is empty, a whole batch from the pool replaces it
+        void* batch = centralPop(idx);
+        if (batch != NULL) {
+            tc->bins[idx] = batch;
+            tc->counts[idx] = CENTRAL_BATCH;
+            tc->bytes += CENTRAL_BATCH * size;
+            return;
+        }
+    }
+    Heap* arena = lockArena();
+    for (int i = 0; i < count; i++) {
+        void* ptr = localMalloc(arena, size);
+        if (ptr == NULL) {
+            break;
+        }
+        *(void**)ptr = tc->bins[idx];
+        tc->bins[idx] = ptr;
+        tc->counts[idx]++;
+        tc->bytes += size;
+    }
+    unlockMutex(&arena->lock);
+}
+
+static void tcacheFlush(ThreadCache* tc, size_t target) {
+    if (tc->bytes <= target) {
+        return;
+    }
+    // Hand cached blocks back to their arenas, largest bins first, keeping
+    // an arena locked for as long as consecutive blocks belong to it
+    Heap* arena = NULL;
+    for (int i = TCACHE_BINS - 1; i >= 0 && tc->bytes > target; i--) {
+        if (centralEnabled && (size_t)(i + 1) * TCACHE_STEP <= SLAB_MAX_SIZE) {
+            while (tc->bytes > target && tcacheFlushBatch(tc, i)) {
+            }
+        }
+        while (tc->bins[i] != NULL && tc->bytes > target) {
+            void* ptr = tc->bins[i];
+            tc->bins[i] = *(void**)ptr;
+            tc->counts[i]--;
+            tc->bytes -= (size_t)(i + 1) * TCACHE_STEP;
+            unsigned long owner = blockOwner(ptr);
+            if (arena != heapTable[owner]) {
+                if (arena != NULL) {
+                    unlockMutex(&arena->lock);
+                }
+                arena = lockHeapArena(owner);
+            }
+            else {
+                arena->freeCount++;
+            }
+            localFree(arena, ptr);
+        }
+    }
+    if (arena != NULL) {
+        unlockMutex(&arena->lock);
+    }
+}
+
+static int tcacheFlushBatch(ThreadCache* tc, int idx) {
+    // Move the first CENTRAL_BATCH blocks of a bin to the pool if they are
+    // all slab objects of the bin's class and the pool has room
+    size_t size = (size_t)(idx + 1) * TCACHE_STEP;
+    if (tc->counts[idx] < CENTRAL_BATCH || __atomic_load_n(&centralCounts[idx], __ATOMIC_RELAXED) >= CENTRAL_MAX_BYTES / (CENTRAL_BATCH * size)) {
+        return 0;
+    }
+    void* last = NULL;
+    void* ptr = tc->bins[idx];
+    for (int i = 0; i < CENTRAL_BATCH; i++) {
+        if (!isSlabObject(ptr) || slabOf(ptr)->objectSize != size) {
+            return 0;
+        }
+        last = ptr;
+        ptr = *(void**)ptr;
+    }
+    void* batch = tc->bins[idx];
+    tc->bins[idx] = ptr;
+    *(void**)last = NULL;
+    tc->counts[idx] -= CENTRAL_BATCH;
+    tc->bytes -= CENTRAL_BATCH * size;
+    centralPush(idx, batch);
+    return 1;
+}
+
+static void centralPush(int sizeClass, void* batch) {
+    unsigned long offset = (char*)batch - slabBase;
+    unsigned long head = __atomic_load_n(&centralHeads[sizeClass], __ATOMIC_RELAXED);
+    unsigned long next;
+    do {
+        __atomic_store_n((unsigned long*)batch + 1, head & CENTRAL_OFFSET_MASK, __ATOMIC_RELAXED);
+        next = offset | ((head & ~CENTRAL_OFFSET_MASK) + CENTRAL_TAG_ONE);
+    } while (!__atomic_compare_exchange_n(&centralHeads[sizeClass], &head, next, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    __atomic_fetch_add(&centralCounts[sizeClass], 1, __ATOMIC_RELAXED);
+}
+
+static void* centralPop(int sizeClass) {
+    // Another thread may take the top batch and hand its objects out before
+    // the link is read. Slab pages stay mapped, so the read is harmless, and
+    // the tag has changed by then, so the exchange fails and we retry.
+    unsigned long head = __atomic_load_n(&centralHeads[sizeClass], __ATOMIC_ACQUIRE);
+    unsigned long next;
+    do {
+        if ((head & CENTRAL_OFFSET_MASK) == 0) { // Offset 0 is a slab header, never an object
+            return NULL;
+        }
+        unsigned long* batch = (unsigned long*)(slabBase + (head & CENTRAL_OFFSET_MASK));
+        next = __atomic_load_n(batch + 1, __ATOMIC_RELAXED) | ((head & ~CENTRAL_OFFSET_MASK) + CENTRAL_TAG_ONE);
+    } while (!__atomic_compare_exchange_n(&centralHeads[sizeClass], &head, next, 1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+    __atomic_fetch_sub(&centralCounts[sizeClass], 1, __ATOMIC_RELAXED);
+    return slabBase + (head & CENTRAL_OFFSET_MASK);
+}
+
+static void centralDrain(void) {
+    // Return every pooled object to the slab it came from
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        void* batch;
+        while ((batch = centralPop(i)) != NULL) {
+            while (batch != NULL) {
+                void* next = *(void**)batch;
+                Heap* arena = lockHeapArena(blockOwner(batch));
+                localFree(arena, batch);
+                unlockMutex(&arena->lock);
+                batch = next;
+            }
+        }
+    }
+}
+
+static int initCpuCaches(void) {
+    // Map the caches once, pages are touched only by the CPUs that exist
+    if (__atomic_load_n(&cpuCaches, __ATOMIC_ACQUIRE) != NULL) {
+        return 1;
+    }
+    acquireMutex(&mutex);
+    if (cpuCaches == NULL) {
+        void* caches = mmap(NULL, CPU_CACHE_MAX_CPUS * sizeof(CpuCache), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (caches != MAP_FAILED) {
+            __atomic_store_n(&cpuCaches, caches, __ATOMIC_RELEASE);
+        }
+    }
+    unlockMutex(&mutex);
+    return cpuCaches != NULL;
+}
+
+static struct rseq* getRseq(void) {
+    // Use the C library's registration, or register the thread ourselves.
+    // Without rseq the thread keeps using its thread cache.
+#if defined(__x86_64__)
+    if (threadRseq != NULL || rseqFailed) {
+        return threadRseq;
+    }
+    if (&__rseq_size != NULL && __rseq_size >= offsetof(struct rseq, flags)) {
+        char* threadPointer;
+        __asm__("movq %%fs:0, %0" : "=r"(threadPointer));
+        threadRseq = (struct rseq*)(threadPointer + __rseq_offset);
+    }
+    else if (syscall(SYS_rseq, &rseqArea, sizeof(rseqArea), 0, RSEQ_SIG) == 0) {
+        threadRseq = &rseqArea;
+    }
+    else {
+        rseqFailed = 1;
+    }
+    return threadRseq;
+#else
+    return NULL;
+#endif
+}
+
+// Both sequences below run on x86-64 only, elsewhere getRseq() keeps them
+// from being called. The descriptor gives the range from label 1 up to the
+// commit store ending at label 2 and the abort handler at label 4, which
+// the kernel only enters after checking the signature right before it. An
+// abort starts the sequence over at label 5. Unknown or high CPU numbers
+// fall through to the miss path.
+static void* cpuCachePop(struct rseq* rs, int idx) {
+#if defined(__x86_64__)
+    void* res;
+    unsigned long cache, count;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "5:\n\t"
+        "leaq 3b(%%rip), %[cache]\n\t"
+        "movq %[cache], %c[csOff](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuOff](%[rs]), %k[cache]\n\t"
+        "cmpl %[maxCpus], %k[cache]\n\t"
+        "jae 6f\n\t"
+        "imulq %[stride], %[cache], %[cache]\n\t"
+        "addq %[base], %[cache]\n\t"
+        "movq (%[cache], %[idx], 8), %[count]\n\t"
+        "testq %[count], %[count]\n\t"
+        "jz 6f\n\t"
+        "subq $1, %[count]\n\t"
+        "leaq (%[first], %[count]), %[res]\n\t"
+        "movq %c[slotsOff](%[cache], %[res], 8), %[res]\n\t"
+        "movq %[count], (%[cache], %[idx], 8)\n\t"
+        "2:\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "xorl %k[res], %k[res]\n\t"
+        "7:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp 5b\n\t"
+        ".popsection\n\t"
+        : [res] "=&r"(res), [cache] "=&r"(cache), [count] "=&r"(count)
+        : [rs] "r"(rs), [base] "r"(cpuCaches), [idx] "r"((long)idx), [first] "r"((long)idx * CPU_CACHE_SLOTS),
+          [csOff] "i"(offsetof(struct rseq, rseq_cs)), [cpuOff] "i"(offsetof(struct rseq, cpu_id)),
+          [slotsOff] "i"(offsetof(CpuCache, slots)), [stride] "i"(sizeof(CpuCache)),
+          [maxCpus] "i"(CPU_CACHE_MAX_CPUS), [sig] "i"(RSEQ_SIG)
+        : "memory", "cc");
+    return res;
+#else
+    return NULL;
+#endif
+}
+
+static int cpuCachePush(struct rseq* rs, int idx, void* ptr) {
+#if defined(__x86_64__)
+    int res;
+    unsigned long cache, count, slot;
+    __asm__ __volatile__(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0, 0\n\t"
+        ".quad 1f, 2f - 1f, 4f\n\t"
+        ".popsection\n\t"
+        "5:\n\t"
+        "leaq 3b(%%rip), %[cache]\n\t"
+        "movq %[cache], %c[csOff](%[rs])\n\t"
+        "1:\n\t"
+        "movl %c[cpuOff](%[rs]), %k[cache]\n\t"
+        "cmpl %[maxCpus], %k[cache]\n\t"
+        "jae 6f\n\t"
+        "imulq %[stride], %[cache], %[cache]\n\t"
+        "addq %[base], %[cache]\n\t"
+        "movq (%[cache], %[idx], 8), %[count]\n\t"
+        "cmpq %[slots], %[count]\n\t"
+        "jae 6f\n\t"
+        "leaq (%[first], %[count]), %[slot]\n\t"
+        "movq %[ptr], %c[slotsOff](%[cache], %[slot], 8)\n\t"
+        "addq $1, %[count]\n\t"
+        "movq %[count], (%[cache], %[idx], 8)\n\t"
+        "2:\n\t"
+        "movl $1, %[res]\n\t"
+        "jmp 7f\n\t"
+        "6:\n\t"
+        "xorl %[res], %[res]\n\t"
+        "7:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long %c[sig]\n\t"
+        "4:\n\t"
+        "jmp 5b\n\t"
+        ".popsection\n\t"
+        : [res] "=&r"(res), [cache] "=&r"(cache), [count] "=&r"(count), [slot] "=&r"(slot)
+        : [rs] "r"(rs), [base] "r"(cpuCaches), [idx] "r"((long)idx), [first] "r"((long)idx * CPU_CACHE_SLOTS),
+          [ptr] "r"(ptr), [csOff] "i"(offsetof(struct rseq, rseq_cs)), [cpuOff] "i"(offsetof(struct rseq, cpu_id)),
+          [slotsOff] "i"(offsetof(CpuCache, slots)), [stride] "i"(sizeof(CpuCache)),
+          [maxCpus] "i"(CPU_CACHE_MAX_CPUS), [slots] "i"(CPU_CACHE_SLOTS), [sig] "i"(RSEQ_SIG)
+        : "memory", "cc");
+    return res;
+#else
+    return 0;
+#endif
+}
+
+static void* cpuCacheMalloc(size_t size) {
+    // NULL sends the request on to the thread cache
+    struct rseq* rs = getRseq();
+    if (rs == NULL) {
+        return NULL;
+    }
+    int idx = (int)((size - 1) / SLAB_STEP);
+    void* ptr = cpuCachePop(rs, idx);
+    if (ptr != NULL) {
+        return ptr;
+    }
+    // Refill half the class from the pool or under one arena lock and keep
+    // the first object for the caller. What no longer fits, after a
+    // migration or other threads' frees, goes straight back.
+    size = (size_t)(idx + 1) * SLAB_STEP;
+    void* batch[CPU_CACHE_FILL];
+    size_t count = 0;
+    void* list = centralEnabled ? centralPop(idx) : NULL;
+    if (list != NULL) {
+        while (list != NULL) {
+            batch[count++] = list;
+            list = *(void**)list;
         }
-        else {
-            if (currNode->size < size + LLSIZE) {
-                // Space isn't enough to divide to 2 nodes, use the whole space directly
-                void* ans = deleteNode(currNode);
-                res = ans;
-                break;
-            }
-            else {
-                // Space can be divided
-                void* ans = divide(currNode, size);
-                res = ans;
-                break;
-            }
+    }
+    else {
+        Heap* arena = lockArena();
+        count = heapMallocBatch(arena, size, CPU_CACHE_FILL, batch);
+        unlockMutex(&arena->lock);
+    }
+    if (count == 0) {
+        return NULL;
+    }
+    size_t i = 1;
+    while (i < count && cpuCachePush(rs, idx, batch[i])) {
+        i++;
+    }
+    if (i < count) {
+        freeBatchLock(batch + i, count - i);
+    }
+    return batch[0];
+}
+
+static int cpuCacheFree(void* ptr, size_t size) {
+    // Returns 0 when the caller has to free the object itself
+    struct rseq* rs = getRseq();
+    if (rs == NULL) {
+        return 0;
+    }
+    int idx = (int)(size / SLAB_STEP) - 1;
+    if (cpuCachePush(rs, idx, ptr)) {
+        return 1;
+    }
+    cpuCacheFlush(rs, idx);
+    return cpuCachePush(rs, idx, ptr);
+}
+
+static void cpuCacheFlush(struct rseq* rs, int idx) {
+    // Hand half the class on as one pool batch if it is a full batch of
+    // slab objects of the class and the pool has room, otherwise to the
+    // arenas. Refills carve heap nodes once the slab region is used up.
+    size_t size = (size_t)(idx + 1) * SLAB_STEP;
+    void* batch[CPU_CACHE_FILL];
+    size_t count = 0;
+    while (count < CPU_CACHE_FILL && (batch[count] = cpuCachePop(rs, idx)) != NULL) {
+        count++;
+    }
+    int pooled = centralEnabled && count == CENTRAL_BATCH && __atomic_load_n(&centralCounts[idx], __ATOMIC_RELAXED) < CENTRAL_MAX_BYTES / (CENTRAL_BATCH * size);
+    for (size_t i = 0; i < count && pooled; i++) {
+        pooled = isSlabObject(batch[i]) && slabOf(batch[i])->objectSize == size;
+    }
+    if (pooled) {
+        for (size_t i = 0; i < count; i++) {
+            *(void**)batch[i] = (i + 1 < count) ? batch[i + 1] : NULL;
         }
+        centralPush(idx, batch[0]);
+        return;
+    }
+    freeBatchLock(batch, count);
+}
+
+static void cpuCacheDrain(void) {
+    // Other CPUs' caches can only be changed by threads running on them
+    struct rseq* rs = (cpuCaches != NULL) ? getRseq() : NULL;
+    if (rs == NULL) {
+        return;
     }
-    if (currNode == NULL) { // There is no appropriate space, use sbrk() to allocate new space
-        void* tmp = sbrk(size + LLSIZE);
-        LinkList* Node = tmp;
-        data_segment_size += size + LLSIZE;
-        eraseNode(Node);
-        Node->size = size;
-        Node->address = tmp + LLSIZE;
-        res = Node->address;
+    for (int i = 0; i < SLAB_CLASSES; i++) {
+        void* batch[CPU_CACHE_SLOTS];
+        size_t count = 0;
+        while (count < CPU_CACHE_SLOTS && (batch[count] = cpuCachePop(rs, i)) != NULL) {
+            count++;
+        }
+        freeBatchLock(batch, count);
     }
-    pthread_mutex_unlock(&mutex);
-    return res;
 }
 
-void ts_free_lock(void* ptr) {
-    if (ptr == NULL) {
+static void cpuCacheDrainAll(void) {
+    // Visit every CPU the thread may run on and drain its cache there. A
+    // thread preempted on that CPU in the middle of a push or pop restarts
+    // it, so nothing else changes the cache meanwhile.
+    cpu_set_t allowed;
+    if (cpuCaches == NULL || getRseq() == NULL || sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        cpuCacheDrain();
         return;
     }
-    pthread_mutex_lock(&mutex);
+    for (int cpu = 0; cpu < CPU_CACHE_MAX_CPUS && cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        cpu_set_t one;
+        CPU_ZERO(&one);
+        CPU_SET(cpu, &one);
+        if (sched_setaffinity(0, sizeof(one), &one) == 0) {
+            cpuCacheDrain();
+        }
+    }
+    sched_setaffinity(0, sizeof(allowed), &allowed);
+}
+
+static void* heapMalloc(Heap* heap, size_t size) {
+    LinkList* currNode = (mallocMode == TS_MODE_SEGREGATED) ? findSegregated(heap, size) : findFirstFit(heap, size);
+    STAT_ADD(searches, 1);
+    if (currNode == NULL) {
+        return NULL;
+    }
+    if (mallocMode == TS_MODE_SEGREGATED) {
+        STAT_ADD(nodesScanned, 1);
+    }
+    return allocNode(heap, currNode, size);
+}
+
+static void* allocNode(Heap* heap, LinkList* currNode, size_t size) {
+    int fresh = ((void*)currNode >= heap->freshStart && (void*)currNode < heap->segmentEnd);
+    if (nodeSize(currNode) < size + LLSIZE + MIN_PAYLOAD) {
+        // Space isn't enough to divide to 2 nodes, use the whole space directly
+        deleteNode(heap, currNode);
+    }
+    else {
+        // Space can be divided
+        divide(heap, currNode, size);
+    }
+    if (fresh) {
+        currNode->head |= NODE_FRESH;
+    }
+    markUsed(heap, currNode);
+    return nodeAddress(currNode);
+}
+
+static void markUsed(Heap* heap, LinkList* Node) {
+    // Past freshStart the latest segment only holds the header and links
+    // of the free node starting there, all else is still zero from sbrk()
+    void* end = nodeAddress(Node) + nodeSize(Node);
+    if (end > heap->freshStart && end <= heap->segmentEnd) {
+        heap->freshStart = end;
+    }
+}
+
+static void heapFree(Heap* heap, void* ptr) {
     // Get current node
     LinkList* currNode = ptr - LLSIZE;
-    currNode->isFree = 1;
-    data_segment_free_space_size += currNode->size + LLSIZE;
+    currNode->head = (currNode->head & ~NODE_FRESH) | NODE_FREE;
+    setFooter(currNode);
+    heap->freeSpaceSize += nodeSize(currNode) + LLSIZE;
+    if (heap->dirtyBytes == 0 && purgeDecayMs >= 0) {
+        heap->dirtySince = currentMs();
+    }
+    heap->dirtyBytes += nodeSize(currNode);
     // Insert the free node to memory and conquer adjacent free space
-    conquer(currNode);
-    pthread_mutex_unlock(&mutex);
+    currNode = conquer(heap, currNode);
+    if (nodeSize(currNode) >= trimThreshold && nodeAddress(currNode) + nodeSize(currNode) == heap->segmentEnd - LLSIZE) {
+        trimHeap(heap, growMin);
+    }
+    decayHeap(heap);
 }
 
-void* ts_malloc_nolock(size_t size) {
-     if (size <= 0) {
-           return NULL;
-       }
-       void* res = NULL;
-       LinkList* currNode = HeadNodeNoLock; // Start find appropriate node to allocate memory
-       while (currNode != NULL) {
-           if (currNode->size < size) {
-               // No enough space, move to next node
-               currNode = currNode->nextNode;
-           }
-           else {
-               if (currNode->size < size + LLSIZE) {
-                   // Space isn't enough to divide to 2 nodes, use the whole space directly
-                   void* ans = deleteNodeNoLock(currNode);
-                   res = ans;
-                   break;
-               }
-               else {
-                   // Space can be divided
-                   void* ans = divideNoLock(currNode, size);
-                   res = ans;
-                   break;
-               }
-           }
-       }
-       if (currNode == NULL) { // There is no appropriate space, use sbrk() to allocate new space
-           pthread_mutex_lock(&mutex);
-           void* tmp = sbrk(size + LLSIZE);
-           pthread_mutex_unlock(&mutex);
-           LinkList* Node = tmp;
-           data_segment_size += size + LLSIZE;
-           eraseNode(Node);
-           Node->size = size;
-           Node->address = tmp + LLSIZE;
-           res = Node->address;
-       }
-       return res;
+int ts_malloc_trim(size_t pad) {
+    // Give back what the calling thread can reach: its cache, the cache of
+    // the CPU it runs on, the central pool, every arena, its own nolock heap
+    // and the heaps left by exited threads
+    int released = 0;
+    pthread_once(&initOnce, initMalloc);
+    tcacheFlush(&threadCache, 0);
+    cpuCacheDrain();
+    centralDrain();
+    for (unsigned long i = 0; i < arenaCount; i++) {
+        Heap* arena = heapTable[i];
+        lockMutex(&arena->lock);
+        released |= trimHeap(arena, pad);
+        released |= purgeHeap(arena);
+        unlockMutex(&arena->lock);
+    }
+    unsigned long count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    for (unsigned long i = arenaCount; i < count; i++) {
+        Heap* heap = heapTable[i];
+        int owned = 0;
+        if (heap == NoLockHeap) {
+            owned = 1;
+        }
+        else if (!__atomic_compare_exchange_n(&heap->owned, &owned, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            continue;
+        }
+        drainRemote(heap);
+        released |= trimHeap(heap, pad);
+        released |= purgeHeap(heap);
+        if (heap != NoLockHeap) {
+            __atomic_store_n(&heap->owned, 0, __ATOMIC_RELEASE);
+        }
+    }
+    return released;
 }
 
-void ts_free_nolock(void* ptr) {
-    // The same as ff_free()
-    LinkList* currNode = ptr - LLSIZE;
-    currNode->isFree = 1;
-    data_segment_free_space_size += currNode->size + LLSIZE;
-    conquer(currNode);
+static MallocStats* getStats(void) {
+    // Claim a slot on the first count of a thread
+    if (threadStats == NULL) {
+        for (int i = 0; i < STAT_SLOTS; i++) {
+            int inUse = 0;
+            if (statSlots[i].inUse == 0 && __atomic_compare_exchange_n(&statSlots[i].inUse, &inUse, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                threadStats = &statSlots[i];
+                threadStats->tid = gettid();
+                registerThread();
+                break;
+            }
+        }
+        if (threadStats == NULL) {
+            return NULL;
+        }
+    }
+    return &threadStats->stats;
 }
 
-void eraseNode(LinkList* currNode){
-    assert(currNode != NULL);
-    // Erase one node from memory
-    currNode->nextNode = NULL;
-    currNode->prevNode = NULL;
-    currNode->isFree = 0;
+static void statMalloc(void* ptr) {
+    if (ptr != NULL) {
+        STAT_ADD(mallocCalls, 1);
+        STAT_ADD(allocatedBytes, blockSize(ptr));
+    }
 }
 
-void* deleteNode(LinkList* currNode){
-    if (currNode == NULL) {
-        return NULL;
+static void statFree(void* ptr) {
+    if (ptr != NULL) {
+        STAT_ADD(freeCalls, 1);
+        STAT_ADD(freedBytes, blockSize(ptr));
     }
-    // Remove one node and make change to its adjacent node
-    HeadNode = (currNode->prevNode == NULL) ? currNode->nextNode :
-    (currNode->nextNode == NULL && currNode->prevNode == NULL) ? NULL : HeadNode;
-    TailNode = (currNode->nextNode == NULL) ? currNode->prevNode :
-    (currNode->nextNode == NULL && currNode->prevNode == NULL) ? NULL : TailNode;
-    if (currNode->nextNode == NULL){
-        if (currNode->prevNode == NULL) {
-            return currNode->address;
-        }
-        currNode->prevNode->nextNode = NULL;
+}
+
+static void initLock(TsLock* lock) {
+    memset(lock, 0, sizeof(TsLock));
+    pthread_mutex_init(&lock->mutex, NULL);
+}
+
+static int trylockMutex(TsLock* lock) {
+    int taken = 0;
+    if (lockKind == TS_LOCK_TICKET) {
+        // Free when no ticket is out past the one being served
+        unsigned int ticket = __atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+        taken = __atomic_compare_exchange_n(&lock->nextTicket, &ticket, ticket + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
     }
-    else if (currNode->prevNode == NULL){
-        if (currNode->nextNode == NULL) {
-            return currNode->address;
+    else if (lockKind == TS_LOCK_MCS) {
+        MCSNode* node = takeMCSNode();
+        MCSNode* tail = NULL;
+        node->next = NULL;
+        taken = __atomic_compare_exchange_n(&lock->tail, &tail, node, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+        if (taken) {
+            lock->holder = node;
+        }
+        else {
+            node->inUse = 0;
         }
-        currNode->nextNode->prevNode = NULL;
+    }
+    else if (lockKind == TS_LOCK_ADAPTIVE) {
+        int state = 0;
+        taken = __atomic_compare_exchange_n(&lock->futex, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
     }
     else {
-        currNode->prevNode->nextNode = currNode->nextNode;
-        currNode->nextNode->prevNode = currNode->prevNode;
+        taken = (pthread_mutex_trylock(&lock->mutex) == 0);
     }
-    eraseNode(currNode);
-    data_segment_free_space_size -= currNode->size + LLSIZE;
-    return currNode->address;
-    
+    if (taken) {
+        __atomic_store_n(&lock->stats.acquired, lock->stats.acquired + 1, __ATOMIC_RELAXED);
+    }
+    return taken;
 }
 
-void* deleteNodeNoLock(LinkList* currNode){
-    if (currNode == NULL) {
-        return NULL;
+static void waitMutex(TsLock* lock) {
+    // The slow path, after trylockMutex() found the lock held
+    unsigned long spins = 0;
+    unsigned long sleeps = 0;
+    if (lockKind == TS_LOCK_TICKET) {
+        unsigned int ticket = __atomic_fetch_add(&lock->nextTicket, 1, __ATOMIC_RELAXED);
+        while (__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket) {
+            spinPause(&spins, &sleeps);
+        }
     }
-    // Remove one node and make change to its adjacent node
-    HeadNodeNoLock = (currNode->prevNode == NULL) ? currNode->nextNode :
-    (currNode->nextNode == NULL && currNode->prevNode == NULL) ? NULL : HeadNodeNoLock;
-    TailNodeNoLock = (currNode->nextNode == NULL) ? currNode->prevNode :
-    (currNode->nextNode == NULL && currNode->prevNode == NULL) ? NULL : TailNodeNoLock;
-    if (currNode->nextNode == NULL){
-        if (currNode->prevNode == NULL) {
-            return currNode->address;
+    else if (lockKind == TS_LOCK_MCS) {
+        MCSNode* node = takeMCSNode();
+        node->next = NULL;
+        node->locked = 1;
+        MCSNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+        if (prev != NULL) {
+            __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+            while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+                spinPause(&spins, &sleeps);
+            }
         }
-        currNode->prevNode->nextNode = NULL;
+        lock->holder = node;
     }
-    else if (currNode->prevNode == NULL){
-        if (currNode->nextNode == NULL) {
-            return currNode->address;
+    else if (lockKind == TS_LOCK_ADAPTIVE) {
+        // Spin up to twice the recent average, a holder that is about to
+        // leave is cheaper to wait for than a sleep and a wake-up
+        int limit = (spinYield == 1) ? 0 : 2 * lock->spinAvg + 16;
+        limit = (limit > LOCK_SPIN_MAX) ? LOCK_SPIN_MAX : limit;
+        int state = 1;
+        while (spins < (unsigned long)limit) {
+            spinPause(&spins, &sleeps);
+            state = 0;
+            if (__atomic_load_n(&lock->futex, __ATOMIC_RELAXED) == 0
+                && __atomic_compare_exchange_n(&lock->futex, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+                break;
+            }
+            state = 1;
+        }
+        if (state != 0) {
+            // Mark the lock as having sleepers, so that unlock wakes one
+            state = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+            while (state != 0) {
+                futexWait(&lock->futex, 2);
+                sleeps++;
+                state = __atomic_exchange_n(&lock->futex, 2, __ATOMIC_ACQUIRE);
+            }
         }
-        currNode->nextNode->prevNode = NULL;
+        lock->spinAvg += ((int)spins - lock->spinAvg) / 8;
     }
     else {
-        currNode->prevNode->nextNode = currNode->nextNode;
-        currNode->nextNode->prevNode = currNode->prevNode;
+        pthread_mutex_lock(&lock->mutex);
     }
-    eraseNode(currNode);
-    return currNode->address;
-    
+    LockStats* stats = &lock->stats;
+    __atomic_store_n(&stats->acquired, stats->acquired + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->contended, stats->contended + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->spins, stats->spins + spins, __ATOMIC_RELAXED);
+    __atomic_store_n(&stats->sleeps, stats->sleeps + sleeps, __ATOMIC_RELAXED);
 }
 
-void* divide(LinkList* currNode, size_t size){
-    if (currNode == NULL) {
-        return NULL;
+static void acquireMutex(TsLock* lock) {
+    if (!trylockMutex(lock)) {
+        waitMutex(lock);
     }
-    // Divive a new node
-    LinkList* newNode = currNode->address + size;
-    data_segment_free_space_size -= size + LLSIZE;
-    newNode->nextNode = currNode->nextNode;
-    newNode->prevNode = currNode->prevNode;
-    newNode->address = newNode + 1;
-    newNode->size = currNode->size - (size + LLSIZE);
-    newNode->isFree = 1;
-    HeadNode = (currNode->prevNode == NULL) ? newNode : HeadNode;
-    TailNode = (currNode->nextNode == NULL) ? newNode : TailNode;
-    if (currNode->prevNode != NULL) {
-        currNode->prevNode->nextNode = newNode;
+}
+
+static void lockMutex(TsLock* lock) {
+    // Only acquisitions that have to wait are timed
+    if (trylockMutex(lock)) {
+        STAT_ADD(lockAcquired, 1);
+        return;
     }
-    if (currNode->nextNode != NULL) {
-        currNode->nextNode->prevNode = newNode;
+    if (!statsEnabled) {
+        waitMutex(lock);
+        return;
     }
-    currNode->size = size;
-    eraseNode(currNode);
-    return currNode->address;
+    long start = currentNs();
+    waitMutex(lock);
+    STAT_ADD(lockWaitNs, currentNs() - start);
+    STAT_ADD(lockContended, 1);
+    STAT_ADD(lockAcquired, 1);
 }
 
-void* divideNoLock(LinkList* currNode, size_t size){
-    if (currNode == NULL) {
-        return NULL;
+static void unlockMutex(TsLock* lock) {
+    if (lockKind == TS_LOCK_TICKET) {
+        __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
     }
-    // Divive a new node
-    LinkList* newNode = currNode->address + size;
-    newNode->nextNode = currNode->nextNode;
-    newNode->prevNode = currNode->prevNode;
-    newNode->address = newNode + 1;
-    newNode->size = currNode->size - (size + LLSIZE);
-    newNode->isFree = 1;
-    HeadNodeNoLock = (currNode->prevNode == NULL) ? newNode : HeadNodeNoLock;
-    TailNodeNoLock = (currNode->nextNode == NULL) ? newNode : TailNodeNoLock;
-    if (currNode->prevNode != NULL) {
-        currNode->prevNode->nextNode = newNode;
+    else if (lockKind == TS_LOCK_MCS) {
+        // Hand the lock to the next waiter, or leave it free if there is
+        // none. A waiter that has swapped itself in but not linked its
+        // node yet is waited for.
+        MCSNode* node = lock->holder;
+        MCSNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+        if (next == NULL) {
+            MCSNode* tail = node;
+            if (__atomic_compare_exchange_n(&lock->tail, &tail, NULL, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+                node->inUse = 0;
+                return;
+            }
+            unsigned long spins = 0;
+            unsigned long sleeps = 0;
+            while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+                spinPause(&spins, &sleeps);
+            }
+        }
+        __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+        node->inUse = 0;
     }
-    if (currNode->nextNode != NULL) {
-        currNode->nextNode->prevNode = newNode;
+    else if (lockKind == TS_LOCK_ADAPTIVE) {
+        if (__atomic_exchange_n(&lock->futex, 0, __ATOMIC_RELEASE) == 2) {
+            futexWake(&lock->futex);
+        }
+    }
+    else {
+        pthread_mutex_unlock(&lock->mutex);
     }
-    currNode->size = size;
-    eraseNode(currNode);
-    return currNode->address;
 }
 
-void Traverse(LinkList* Node, int type){
-    if (Node == NULL) {
-        return;
-    }
-    // Follow the list, find the best position to insert
-    LinkList* currNode = NULL;
-    if (type > 0) {
-        currNode = HeadNode;
-        while (currNode != TailNode && currNode->nextNode->address < Node->address) {
-            currNode = currNode->nextNode;
+static MCSNode* takeMCSNode(void) {
+    // A thread holds few locks at a time, the first free node is near
+    for (int i = 0; i < MCS_NODES; i++) {
+        if (!mcsNodes[i].inUse) {
+            mcsNodes[i].inUse = 1;
+            return &mcsNodes[i];
         }
     }
+    abort();
+}
+
+static void spinPause(unsigned long* spins, unsigned long* sleeps) {
+    if (++*spins % spinYield == 0) {
+        sched_yield();
+        ++*sleeps;
+    }
     else {
-        currNode = TailNode;
-        while (currNode != HeadNode && currNode->prevNode->address > Node->address) {
-            currNode = currNode->prevNode;
+#if defined(__x86_64__) || defined(__i386__)
+        __builtin_ia32_pause();
+#endif
+    }
+}
+
+static void futexWait(int* addr, int value) {
+    syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+static void futexWake(int* addr) {
+    syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+const char* ts_malloc_lock_name(void) {
+    pthread_once(&initOnce, initMalloc);
+    return lockNames[lockKind];
+}
+
+void ts_malloc_lock_stats(LockStats* stats) {
+    memset(stats, 0, sizeof(LockStats));
+    pthread_once(&initOnce, initMalloc);
+    addLockStats(stats, &mutex.stats);
+    for (unsigned long i = 0; i < arenaCount; i++) {
+        addLockStats(stats, &heapTable[i]->lock.stats);
+    }
+}
+
+static void addLockStats(LockStats* total, LockStats* stats) {
+    total->acquired += __atomic_load_n(&stats->acquired, __ATOMIC_RELAXED);
+    total->contended += __atomic_load_n(&stats->contended, __ATOMIC_RELAXED);
+    total->spins += __atomic_load_n(&stats->spins, __ATOMIC_RELAXED);
+    total->sleeps += __atomic_load_n(&stats->sleeps, __ATOMIC_RELAXED);
+}
+
+static long currentNs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+static void addStats(MallocStats* total, MallocStats* stats) {
+    // Add the counters, the heap wide fields are filled in separately
+    total->mallocCalls += __atomic_load_n(&stats->mallocCalls, __ATOMIC_RELAXED);
+    total->freeCalls += __atomic_load_n(&stats->freeCalls, __ATOMIC_RELAXED);
+    total->allocatedBytes += __atomic_load_n(&stats->allocatedBytes, __ATOMIC_RELAXED);
+    total->freedBytes += __atomic_load_n(&stats->freedBytes, __ATOMIC_RELAXED);
+    total->sbrkCalls += __atomic_load_n(&stats->sbrkCalls, __ATOMIC_RELAXED);
+    total->mmapCalls += __atomic_load_n(&stats->mmapCalls, __ATOMIC_RELAXED);
+    total->munmapCalls += __atomic_load_n(&stats->munmapCalls, __ATOMIC_RELAXED);
+    total->searches += __atomic_load_n(&stats->searches, __ATOMIC_RELAXED);
+    total->nodesScanned += __atomic_load_n(&stats->nodesScanned, __ATOMIC_RELAXED);
+    total->lockAcquired += __atomic_load_n(&stats->lockAcquired, __ATOMIC_RELAXED);
+    total->lockContended += __atomic_load_n(&stats->lockContended, __ATOMIC_RELAXED);
+    total->lockWaitNs += __atomic_load_n(&stats->lockWaitNs, __ATOMIC_RELAXED);
+    total->bytesInUse = (long)(total->allocatedBytes - total->freedBytes);
+}
+
+void ts_malloc_stats_thread(MallocStats* stats) {
+    memset(stats, 0, sizeof(MallocStats));
+    if (threadStats != NULL) {
+        addStats(stats, &threadStats->stats);
+    }
+    Heap* heap = NoLockHeap;
+    if (heap != NULL) {
+        stats->freeListLength = heap->freeNodes;
+        stats->dataSegmentSize = heap->dataSegmentSize;
+        stats->freeSpaceSize = heap->freeSpaceSize;
+    }
+}
+
+void ts_malloc_stats_total(MallocStats* stats) {
+    memset(stats, 0, sizeof(MallocStats));
+    pthread_once(&initOnce, initMalloc);
+    acquireMutex(&mutex);
+    addStats(stats, &retiredStats);
+    unlockMutex(&mutex);
+    for (int i = 0; i < STAT_SLOTS; i++) {
+        if (__atomic_load_n(&statSlots[i].inUse, __ATOMIC_ACQUIRE)) {
+            addStats(stats, &statSlots[i].stats);
         }
     }
-    LinkList* tempNext = currNode->nextNode;
-    LinkList* tempPrev = currNode->prevNode;
-    if (type > 0) {
-        tempNext->prevNode = Node;
-        currNode->nextNode = Node;
+    // Heaps are read without their locks, the sizes are a snapshot
+    unsigned long count = __atomic_load_n(&heapCount, __ATOMIC_ACQUIRE);
+    for (unsigned long i = 0; i < count; i++) {
+        stats->freeListLength += heapTable[i]->freeNodes;
+        stats->dataSegmentSize += heapTable[i]->dataSegmentSize;
+        stats->freeSpaceSize += heapTable[i]->freeSpaceSize;
     }
-    else {
-        tempPrev->nextNode = Node;
-        currNode->prevNode = Node;
+}
+
+void ts_malloc_stats_print(FILE* out) {
+    MallocStats stats;
+    fprintf(out, "%-8s %12s %12s %14s %8s %8s %10s %10s %12s\n", "thread", "malloc", "free", "in use", "sbrk", "mmap", "avg scan", "contended", "wait ms");
+    for (int i = 0; i < STAT_SLOTS; i++) {
+        if (!__atomic_load_n(&statSlots[i].inUse, __ATOMIC_ACQUIRE)) {
+            continue;
+        }
+        memset(&stats, 0, sizeof(MallocStats));
+        addStats(&stats, &statSlots[i].stats);
+        fprintf(out, "%-8d %12lu %12lu %14ld %8lu %8lu %10.2f %10lu %12.3f\n", statSlots[i].tid, stats.mallocCalls, stats.freeCalls, stats.bytesInUse, stats.sbrkCalls, stats.mmapCalls, (stats.searches > 0) ? (double)stats.nodesScanned / stats.searches : 0.0, stats.lockContended, stats.lockWaitNs / 1e6);
     }
-    Node->nextNode = (type > 0) ? tempNext : currNode;
-    Node->prevNode = (type > 0) ? currNode : tempPrev;
+    ts_malloc_stats_total(&stats);
+    fprintf(out, "%-8s %12lu %12lu %14ld %8lu %8lu %10.2f %10lu %12.3f\n", "total", stats.mallocCalls, stats.freeCalls, stats.bytesInUse, stats.sbrkCalls, stats.mmapCalls, (stats.searches > 0) ? (double)stats.nodesScanned / stats.searches : 0.0, stats.lockContended, stats.lockWaitNs / 1e6);
+    fprintf(out, "free list %lu nodes, data segment %lu bytes, %lu free, %lu lock acquisitions, %lu munmap\n", stats.freeListLength, stats.dataSegmentSize, stats.freeSpaceSize, stats.lockAcquired, stats.munmapCalls);
+    LockStats locks;
+    ts_malloc_lock_stats(&locks);
+    fprintf(out, "%s locks: %lu acquired, %lu contended, %lu spins, %lu sleeps\n", ts_malloc_lock_name(), locks.acquired, locks.contended, locks.spins, locks.sleeps);
 }
 
-void TraverseNoLock(LinkList* Node, int type){
-    if (Node == NULL) {
+static void openTrace(const char* path) {
+    // %p in the path becomes the process id, so that child processes
+    // inheriting the environment write their own trace
+    char name[PATH_MAX];
+    size_t len = 0;
+    for (; *path != '\0' && len < sizeof(name) - 24; path++) {
+        if (path[0] == '%' && path[1] == 'p') {
+            char digits[24];
+            int count = 0;
+            for (long pid = getpid(); pid > 0; pid /= 10) {
+                digits[count++] = '0' + pid % 10;
+            }
+            while (count > 0) {
+                name[len++] = digits[--count];
+            }
+            path++;
+        }
+        else {
+            name[len++] = *path;
+        }
+    }
+    name[len] = '\0';
+    traceFd = open(name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (traceFd < 0) {
+        return;
+    }
+    unsigned long magic = TRACE_MAGIC;
+    if (write(traceFd, &magic, sizeof(magic)) != sizeof(magic)) {
+        close(traceFd);
+        traceFd = -1;
         return;
     }
-    // Follow the list, find the best position to insert
-    LinkList* currNode = NULL;
-    if (type > 0) {
-        currNode = HeadNodeNoLock;
-        while (currNode != TailNodeNoLock && currNode->nextNode->address < Node->address) {
-            currNode = currNode->nextNode;
+    traceStart = currentNs();
+    traceEnabled = 1;
+}
+
+static TraceBuffer* getTraceBuffer(void) {
+    // Claim a buffer on the first event of a thread, like the stat slots
+    if (threadTrace != NULL) {
+        return threadTrace;
+    }
+    TraceBuffer* buf = __atomic_load_n(&traceBuffers, __ATOMIC_ACQUIRE);
+    for (; buf != NULL; buf = buf->next) {
+        int inUse = 0;
+        if (buf->inUse == 0 && __atomic_compare_exchange_n(&buf->inUse, &inUse, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            break;
         }
     }
-    else {
-        currNode = TailNodeNoLock;
-        while (currNode != HeadNodeNoLock && currNode->prevNode->address > Node->address) {
-            currNode = currNode->prevNode;
+    if (buf == NULL) {
+        buf = mmap(NULL, sizeof(TraceBuffer), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        STAT_ADD(mmapCalls, 1);
+        if (buf == MAP_FAILED) {
+            return NULL;
         }
+        buf->inUse = 1;
+        buf->next = __atomic_load_n(&traceBuffers, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&traceBuffers, &buf->next, buf, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
     }
-    LinkList* tempNext = currNode->nextNode;
-    LinkList* tempPrev = currNode->prevNode;
-    if (type > 0) {
-        tempNext->prevNode = Node;
-        currNode->nextNode = Node;
+    // Set first, registering may allocate and record an event
+    buf->tid = gettid();
+    threadTrace = buf;
+    registerThread();
+    return buf;
+}
+
+static void traceRecord(unsigned int op, void* object, unsigned long arg, size_t size, unsigned long releaseSeq) {
+    if (traceHold) {
+        return;
     }
-    else {
-        tempPrev->nextNode = Node;
-        currNode->prevNode = Node;
+    TraceBuffer* buf = getTraceBuffer();
+    if (buf == NULL) {
+        return;
+    }
+    TraceEvent* event = &buf->events[buf->count];
+    event->seq = __atomic_fetch_add(&traceSeq, 1, __ATOMIC_ACQ_REL);
+    event->releaseSeq = releaseSeq;
+    event->timeNs = currentNs() - traceStart;
+    event->object = (unsigned long)object;
+    event->arg = arg;
+    event->size = size;
+    event->tid = buf->tid;
+    event->op = op;
+    if (++buf->count == TRACE_BUFFER_EVENTS) {
+        traceFlush(buf);
     }
-    Node->nextNode = (type > 0) ? tempNext : currNode;
-    Node->prevNode = (type > 0) ? currNode : tempPrev;
 }
 
-void insertNode(LinkList* Node, int type){
-    if (Node == NULL) {
-        return;
+static void* traceRealloc(void* (*resize)(void*, size_t), void* ptr, size_t size) {
+    // One event for the whole call, with an extra seq taken before the old
+    // block can be released. The mallocs and frees inside are not recorded.
+    unsigned long releaseSeq = __atomic_fetch_add(&traceSeq, 1, __ATOMIC_ACQ_REL);
+    traceHold++;
+    void* res = resize(ptr, size);
+    traceHold--;
+    if (res != NULL || size == 0) {
+        traceRecord(TRACE_REALLOC, res, (unsigned long)ptr, size, releaseSeq);
     }
-    // Insert the node based on the type
-    if (type == 1) {
-        HeadNode->prevNode = Node;
-        Node->nextNode = HeadNode;
-        Node->prevNode = NULL;
-        HeadNode = Node;
+    return res;
+}
+
+static void traceFlush(TraceBuffer* buf) {
+    pthread_mutex_lock(&traceLock);
+    size_t done = 0;
+    size_t total = buf->count * sizeof(TraceEvent);
+    while (done < total) {
+        ssize_t written = write(traceFd, (char*)buf->events + done, total - done);
+        if (written <= 0) {
+            break;
+        }
+        done += written;
     }
-    if (type == 2) {
-        TailNode->nextNode = Node;
-        Node->prevNode = TailNode;
-        Node->nextNode = NULL;
-        TailNode = Node;
+    buf->count = 0;
+    pthread_mutex_unlock(&traceLock);
+}
+
+size_t ts_malloc_usable_size(void* ptr) {
+    return (ptr == NULL) ? 0 : blockSize(ptr);
+}
+
+void ts_malloc_prefork(void) {
+    // Arenas before the mutex, the order extendHeap() takes them in
+    pthread_once(&initOnce, initMalloc);
+    for (unsigned long i = 0; i < arenaCount; i++) {
+        acquireMutex(&heapTable[i]->lock);
     }
-    if (type == 3) {
-        Traverse(Node, 1);
+    acquireMutex(&mutex);
+}
+
+void ts_malloc_postfork(void) {
+    unlockMutex(&mutex);
+    for (unsigned long i = arenaCount; i > 0; i--) {
+        unlockMutex(&heapTable[i - 1]->lock);
     }
 }
 
-void insertNodeNoLock(LinkList* Node, int type){
-    if (Node == NULL) {
-        return;
+static int trimHeap(Heap* heap, size_t pad) {
+    // Shrink the break when the heap ends in a free node and its segment is
+    // still the last one, keeping pad bytes of that node
+    if (!TS_OWN_BRK || heap->segmentEnd == NULL) {
+        return 0;
     }
-    // Insert the node based on the type
-    if (type == 1) {
-        HeadNode->prevNode = Node;
-        Node->nextNode = HeadNodeNoLock;
-        Node->prevNode = NULL;
-        HeadNode = Node;
+    LinkList* endNode = heap->segmentEnd - LLSIZE;
+    LinkList* topNode = prevPhysNode(endNode);
+    if (topNode == NULL || nodeSize(topNode) <= pad) {
+        return 0;
     }
-    if (type == 2) {
-        TailNode->nextNode = Node;
-        Node->prevNode = TailNodeNoLock;
-        Node->nextNode = NULL;
-        TailNode = Node;
+    size_t release = (nodeSize(topNode) - pad) & ~(pageSize - 1);
+    if (release == 0) {
+        return 0;
     }
-    if (type == 3) {
-        TraverseNoLock(Node, 1);
+    int released = 0;
+    lockMutex(&mutex);
+    if (sbrk(0) == heap->segmentEnd) {
+        removeNode(heap, topNode);
+        endNode = (void*)endNode - release;
+        STAT_ADD(sbrkCalls, 1);
+        // An absolute end never cuts below this heap, whatever moved the
+        // break since the check
+        if (brk(heap->segmentEnd - release) == 0) {
+            setNodeSize(topNode, nodeSize(topNode) - release);
+            endNode->head = heap->id << HEAP_ID_SHIFT;
+            setFooter(topNode);
+            heap->segmentEnd -= release;
+            if (heap->freshStart > (void*)endNode) {
+                heap->freshStart = endNode;
+            }
+            heap->dataSegmentSize -= release;
+            heap->freeSpaceSize -= release;
+            released = 1;
+        }
+        addNode(heap, topNode);
     }
+    unlockMutex(&mutex);
+    return released;
 }
 
-void addNode(LinkList* Node) {
-    if (Node == NULL) {
-        return;
+static int purgeHeap(Heap* heap) {
+    // Drop the whole pages inside free nodes of at least two pages. The
+    // header and the links stay, so the nodes keep their place on the lists.
+    int released = 0;
+    int fl, sl;
+    mappingInsert(2 * pageSize, &fl, &sl);
+    for (; fl < FL_INDEX_COUNT; fl++) {
+        if ((heap->flBitmap & (1UL << fl)) == 0) {
+            continue;
+        }
+        for (sl = 0; sl < SL_INDEX_COUNT; sl++) {
+            for (LinkList* Node = heap->bins[fl][sl]; Node != NULL; Node = Node->nextBin) {
+                uintptr_t start = ((uintptr_t)nodeAddress(Node) + MIN_PAYLOAD + pageSize - 1) & ~(pageSize - 1);
+                uintptr_t end = ((uintptr_t)nodeAddress(Node) + nodeSize(Node)) & ~(pageSize - 1);
+                if (end > start && madvise((void*)start, end - start, MADV_DONTNEED) == 0) {
+                    released = 1;
+                }
+            }
+        }
     }
-    if (HeadNode == NULL && TailNode == NULL) {
-        HeadNode = Node;
-        TailNode = Node;
-        return;
+    heap->dirtyBytes = 0;
+    return released;
+}
+
+static void decayHeap(Heap* heap) {
+    // Purge once enough was freed and the oldest of it has decayed
+    if (purgeDecayMs >= 0 && heap->dirtyBytes >= PURGE_MIN_DIRTY && currentMs() - heap->dirtySince >= purgeDecayMs) {
+        purgeHeap(heap);
     }
-    int type = (HeadNode->address > Node->address) ? 1 : (TailNode->address < Node->address) ? 2 : 3;
-    insertNode(Node, type);
 }
 
-void addNodeNoLock(LinkList* Node) {
-    if (Node == NULL) {
-        return;
+static long currentMs(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void* extendHeap(Heap* heap, size_t size) {
+    // Grow by a whole chunk so that most misses are served from the free
+    // remainder of an earlier chunk instead of a new sbrk() call. Chunks
+    // start at growMin and double up to GROW_MAX.
+    if (heap->growSize == 0) {
+        heap->growSize = growMin;
     }
-    if (HeadNodeNoLock == NULL && TailNodeNoLock == NULL) {
-        HeadNode = Node;
-        TailNode = Node;
-        return;
+    size_t need = size + 2 * LLSIZE;
+    size_t total = (need > heap->growSize) ? need : heap->growSize;
+    total = (total + pageSize - 1) & ~(pageSize - 1);
+    lockMutex(&mutex);
+    // Skip to an aligned break if someone else left it unaligned
+    size_t pad = -(uintptr_t)sbrk(0) & (ALIGN_SIZE - 1);
+    void* tmp = sbrk(pad + total);
+    STAT_ADD(sbrkCalls, 1);
+    if (tmp == (void*)-1 && total > need) {
+        total = need;
+        tmp = sbrk(pad + total);
+        STAT_ADD(sbrkCalls, 1);
+    }
+    unlockMutex(&mutex);
+    if (tmp == (void*)-1) {
+        return NULL;
+    }
+    tmp += pad;
+    // A shrunk break can leave old data in the rest of its page, the
+    // pages after it come zeroed from the kernel
+    size_t stale = -(uintptr_t)tmp & (pageSize - 1);
+    memset(tmp, 0, (stale < total) ? stale : total);
+    heap->dataSegmentSize += pad + total;
+    heap->growSize = (heap->growSize * 2 < GROW_MAX) ? heap->growSize * 2 : GROW_MAX;
+    // Continue the previous segment when nobody moved the break since, its
+    // end marker then becomes the header of the new node and still tells
+    // whether the node before it is free
+    int contiguous = (tmp == heap->segmentEnd);
+    LinkList* Node = contiguous ? tmp - LLSIZE : tmp;
+    if (!contiguous) {
+        heap->freshStart = tmp;
     }
-    int type = (HeadNodeNoLock->address > Node->address) ? 1 : (TailNodeNoLock->address < Node->address) ? 2 : 3;
-    insertNodeNoLock(Node, type);
+    LinkList* endNode = tmp + total - LLSIZE;
+    size_t prevFree = contiguous ? (Node->head & NODE_PREV_FREE) : 0;
+    endNode->head = heap->id << HEAP_ID_SHIFT;
+    heap->segmentEnd = tmp + total;
+    Node->head = (heap->id << HEAP_ID_SHIFT) | ((void*)endNode - (void*)Node - LLSIZE) | prevFree | NODE_FREE;
+    // The chunk joins a free node at the old end of the segment
+    setFooter(Node);
+    heap->freeSpaceSize += nodeSize(Node) + LLSIZE;
+    LinkList* freeNode = conquer(heap, Node);
+    if (freeNode != Node) {
+        // The old end marker is inside the merged node now
+        memset(Node, 0, LLSIZE);
+    }
+    return allocNode(heap, freeNode, size);
 }
 
-void conquerPrev(LinkList* currNode){
-    if (currNode == NULL) {
+static LinkList* findFirstFit(Heap* heap, size_t size) {
+    // Start find appropriate node to allocate memory
+    LinkList* currNode = heap->headNode;
+    unsigned long scanned = 0;
+    while (currNode != NULL && nodeSize(currNode) < size) {
+        // No enough space, move to next node
+        currNode = currNode->nextNode;
+        scanned++;
+    }
+    STAT_ADD(nodesScanned, scanned + (currNode != NULL));
+    return currNode;
+}
+
+static void mappingInsert(size_t size, int* fl, int* sl) {
+    // Map a size to its first level (power of two) and second level class
+    if (size < SMALL_BLOCK_SIZE) {
+        *fl = 0;
+        *sl = (int)size / (SMALL_BLOCK_SIZE / SL_INDEX_COUNT);
         return;
     }
-    // Conquer current node with its previous node
-    currNode->prevNode->nextNode = currNode->nextNode;
-    currNode->prevNode->size += currNode->size + LLSIZE;
-    if (currNode->nextNode == NULL) {
-        TailNode = currNode->prevNode;
+    int f = 63 - __builtin_clzl(size);
+    *sl = (int)(size >> (f - SL_INDEX_LOG2)) ^ SL_INDEX_COUNT;
+    *fl = f - FL_INDEX_SHIFT + 1;
+}
+
+static LinkList* findSegregated(Heap* heap, size_t size) {
+    // Round the request up to the next class boundary so that every node in
+    // the class found is large enough, then look it up with two bit scans
+    if (size >= SMALL_BLOCK_SIZE) {
+        size += ((size_t)1 << (63 - __builtin_clzl(size) - SL_INDEX_LOG2)) - 1;
+    }
+    int fl, sl;
+    mappingInsert(size, &fl, &sl);
+    if (fl >= FL_INDEX_COUNT) {
+        return NULL;
     }
-    else{
-        currNode->nextNode->prevNode = currNode->prevNode;
-        currNode->prevNode->nextNode = currNode->nextNode;
+    unsigned int slMap = heap->slBitmap[fl] & (~0U << sl);
+    if (slMap == 0) {
+        unsigned long flMap = (fl + 1 < FL_INDEX_COUNT) ? heap->flBitmap & (~0UL << (fl + 1)) : 0;
+        if (flMap == 0) {
+            return NULL;
+        }
+        fl = __builtin_ctzl(flMap);
+        slMap = heap->slBitmap[fl];
     }
+    sl = __builtin_ctz(slMap);
+    return heap->bins[fl][sl];
 }
 
-void conquerPrevNoLock(LinkList* currNode){
-    if (currNode == NULL) {
-        return;
+static void insertBin(Heap* heap, LinkList* Node) {
+    int fl, sl;
+    mappingInsert(nodeSize(Node), &fl, &sl);
+    LinkList* head = heap->bins[fl][sl];
+    Node->prevBin = NULL;
+    Node->nextBin = head;
+    if (head != NULL) {
+        head->prevBin = Node;
     }
-    // Conquer current node with its previous node
-    currNode->prevNode->nextNode = currNode->nextNode;
-    currNode->prevNode->size += currNode->size + LLSIZE;
-    if (currNode->nextNode == NULL) {
-        TailNodeNoLock = currNode->prevNode;
+    heap->bins[fl][sl] = Node;
+    heap->flBitmap |= 1UL << fl;
+    heap->slBitmap[fl] |= 1U << sl;
+}
+
+static void removeBin(Heap* heap, LinkList* Node) {
+    int fl, sl;
+    mappingInsert(nodeSize(Node), &fl, &sl);
+    if (Node->prevBin != NULL) {
+        Node->prevBin->nextBin = Node->nextBin;
+    }
+    else {
+        heap->bins[fl][sl] = Node->nextBin;
     }
-    else{
-        currNode->nextNode->prevNode = currNode->prevNode;
-        currNode->prevNode->nextNode = currNode->nextNode;
+    if (Node->nextBin != NULL) {
+        Node->nextBin->prevBin = Node->prevBin;
     }
+    if (heap->bins[fl][sl] == NULL) {
+        heap->slBitmap[fl] &= ~(1U << sl);
+        if (heap->slBitmap[fl] == 0) {
+            heap->flBitmap &= ~(1UL << fl);
+        }
+    }
+    Node->prevBin = NULL;
+    Node->nextBin = NULL;
 }
 
-void conquerNext(LinkList* currNode){
-    if (currNode == NULL) {
+static size_t nodeSize(LinkList* Node) {
+    return Node->head & NODE_SIZE_MASK;
+}
+
+static unsigned long nodeHeapId(LinkList* Node) {
+    return Node->head >> HEAP_ID_SHIFT;
+}
+
+static void* nodeAddress(LinkList* Node) {
+    return (void*)Node + LLSIZE;
+}
+
+static void setNodeSize(LinkList* Node, size_t size) {
+    Node->head = (Node->head & ~NODE_SIZE_MASK) | size;
+}
+
+static void setFooter(LinkList* Node) {
+    // Tell the next node whether this one is free and where its header is
+    LinkList* nextNode = nodeAddress(Node) + nodeSize(Node);
+    if (Node->head & NODE_FREE) {
+        nextNode->prevSize = nodeSize(Node);
+        nextNode->head |= NODE_PREV_FREE;
+    }
+    else {
+        nextNode->head &= ~NODE_PREV_FREE;
+    }
+}
+
+static LinkList* prevPhysNode(LinkList* Node) {
+    // Only a free previous node leaves its size in our header. Segments
+    // belong to one heap, so a free neighbour is always on the caller's lists.
+    if ((Node->head & NODE_PREV_FREE) == 0) {
+        return NULL;
+    }
+    return (void*)Node - Node->prevSize - LLSIZE;
+}
+
+static LinkList* nextPhysNode(LinkList* Node) {
+    LinkList* nextNode = nodeAddress(Node) + nodeSize(Node);
+    return (nextNode->head & NODE_FREE) ? nextNode : NULL;
+}
+
+static void addNode(Heap* heap, LinkList* Node) {
+    if (Node == NULL) {
         return;
     }
-    // Conquer current node with its next node
-    currNode->size += currNode->nextNode->size + LLSIZE;
-    if (currNode->nextNode->nextNode == NULL) {
-        currNode->nextNode = NULL;
-        TailNode = currNode;
+    // Push the node on the free list and into its size class bin
+    Node->prevNode = NULL;
+    Node->nextNode = heap->headNode;
+    if (heap->headNode != NULL) {
+        heap->headNode->prevNode = Node;
+    }
+    heap->headNode = Node;
+    heap->freeNodes++;
+    insertBin(heap, Node);
+}
+
+static void removeNode(Heap* heap, LinkList* Node) {
+    removeBin(heap, Node);
+    if (Node->prevNode == NULL) {
+        heap->headNode = Node->nextNode;
     }
     else {
-        currNode->nextNode->prevNode = NULL;
-        currNode->nextNode = currNode->nextNode->nextNode;
-        currNode->nextNode->prevNode = currNode;
+        Node->prevNode->nextNode = Node->nextNode;
+    }
+    if (Node->nextNode != NULL) {
+        Node->nextNode->prevNode = Node->prevNode;
     }
+    Node->prevNode = NULL;
+    Node->nextNode = NULL;
+    heap->freeNodes--;
 }
 
-void conquerNextNoLock(LinkList* currNode){
+static void* deleteNode(Heap* heap, LinkList* currNode){
     if (currNode == NULL) {
-        return;
+        return NULL;
     }
-    // Conquer current node with its next node
-    currNode->size += currNode->nextNode->size + LLSIZE;
-    if (currNode->nextNode->nextNode == NULL) {
-        currNode->nextNode = NULL;
-        TailNodeNoLock = currNode;
+    // Remove one node and hand out the whole space
+    removeNode(heap, currNode);
+    currNode->head &= ~NODE_FREE;
+    setFooter(currNode);
+    heap->freeSpaceSize -= nodeSize(currNode) + LLSIZE;
+    return nodeAddress(currNode);
+}
+
+static void* divide(Heap* heap, LinkList* currNode, size_t size){
+    if (currNode == NULL) {
+        return NULL;
+    }
+    // Divive a new node from the tail of the current one, it takes over
+    // the current node's place in the free list
+    removeBin(heap, currNode);
+    LinkList* newNode = nodeAddress(currNode) + size;
+    heap->freeSpaceSize -= size + LLSIZE;
+    newNode->head = (heap->id << HEAP_ID_SHIFT) | (nodeSize(currNode) - size - LLSIZE) | NODE_FREE;
+    setFooter(newNode);
+    newNode->prevNode = currNode->prevNode;
+    newNode->nextNode = currNode->nextNode;
+    if (newNode->prevNode == NULL) {
+        heap->headNode = newNode;
     }
     else {
-        currNode->nextNode->prevNode = NULL;
-        currNode->nextNode = currNode->nextNode->nextNode;
-        currNode->nextNode->prevNode = currNode;
+        newNode->prevNode->nextNode = newNode;
     }
+    if (newNode->nextNode != NULL) {
+        newNode->nextNode->prevNode = newNode;
+    }
+    insertBin(heap, newNode);
+    setNodeSize(currNode, size);
+    currNode->head &= ~NODE_FREE;
+    return nodeAddress(currNode);
 }
 
-void conquer(LinkList* currNode) {
+static void conquerPrev(Heap* heap, LinkList* currNode){
     if (currNode == NULL) {
         return;
     }
-    // First insert node then conquer with its adjacent node
-    addNode(currNode);
-    if (currNode != HeadNode && currNode->prevNode->size == (void*)currNode - currNode->prevNode->address && currNode->isFree == 1) {
-        conquerPrev(currNode);
-        currNode = currNode->prevNode;
-    }
-    if (currNode != TailNode && currNode->size == (void*)currNode->nextNode - currNode->address && currNode->isFree == 1) {
-        conquerNext(currNode);
-    }
+    // Conquer current node with its previous node
+    LinkList* prevNode = prevPhysNode(currNode);
+    removeNode(heap, prevNode);
+    setNodeSize(prevNode, nodeSize(prevNode) + nodeSize(currNode) + LLSIZE);
+    setFooter(prevNode);
 }
 
-void conquerNoLock(LinkList* currNode) {
+static void conquerNext(Heap* heap, LinkList* currNode){
     if (currNode == NULL) {
         return;
     }
-    // First insert node then conquer with its adjacent node
-    addNodeNoLock(currNode);
-    if (currNode != HeadNodeNoLock && currNode->prevNode->size == (void*)currNode - currNode->prevNode->address && currNode->isFree == 1) {
-        conquerPrevNoLock(currNode);
-        currNode = currNode->prevNode;
+    // Conquer current node with its next node
+    LinkList* nextNode = nextPhysNode(currNode);
+    removeNode(heap, nextNode);
+    setNodeSize(currNode, nodeSize(currNode) + nodeSize(nextNode) + LLSIZE);
+    setFooter(currNode);
+}
+
+static LinkList* conquer(Heap* heap, LinkList* currNode) {
+    if (currNode == NULL) {
+        return NULL;
+    }
+    // Merge with free physical neighbours, then insert the merged node
+    LinkList* prevNode = prevPhysNode(currNode);
+    if (prevNode != NULL) {
+        conquerPrev(heap, currNode);
+        currNode = prevNode;
     }
-    if (currNode != TailNodeNoLock && currNode->size == (void*)currNode->nextNode - currNode->address && currNode->isFree == 1) {
-        conquerNextNoLock(currNode);
+    if (nextPhysNode(currNode) != NULL) {
+        conquerNext(heap, currNode);
     }
+    addNode(heap, currNode);
+    return currNode;
 }
@@ -4,14 +4,296 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <unistd.h> // Library for sbrk()
+
+// Segregated size classes (TLSF): a first level per power of two, each split
+// into SL_INDEX_COUNT linear second-level classes. Every size is a multiple
+// of ALIGN_SIZE, which is the alignment of max_align_t on x86-64.
+#define ALIGN_LOG2 4
+#define ALIGN_SIZE (1 << ALIGN_LOG2)
+#define SL_INDEX_LOG2 4
+#define SL_INDEX_COUNT (1 << SL_INDEX_LOG2)
+#define FL_INDEX_SHIFT (SL_INDEX_LOG2 + ALIGN_LOG2)
+#define FL_INDEX_MAX 47
+#define FL_INDEX_COUNT (FL_INDEX_MAX - FL_INDEX_SHIFT + 2)
+#define SMALL_BLOCK_SIZE (1 << FL_INDEX_SHIFT)
+#define CACHE_LINE_SIZE 64 // Blocks aligned to at least this are padded to their alignment
+
+// Every node starts with a two word header: the size of the previous node,
+// valid only while that node is free, and a head word holding the payload
+// size, the flag bits below and the id of the owning heap in the top bits.
+// Allocated nodes carry nothing else, the list and bin links of a free node
+// live in its payload. Each sbrk() segment ends with an allocated, zero
+// sized header so that neighbour lookups stay inside it.
+#define NODE_FREE 1UL
+#define NODE_PREV_FREE 2UL // The previous node is free and prevSize is valid
+#define NODE_MMAPPED 4UL // Node has its own mapping, outside of any heap
+#define NODE_FRESH 8UL // Allocated payload is zero past its first MIN_PAYLOAD bytes
+#define NODE_FLAGS 15UL
+#define HEAP_ID_SHIFT 48
+#define NODE_SIZE_MASK ((1UL << HEAP_ID_SHIFT) - 1 - NODE_FLAGS)
+
 typedef struct _LinkList{
-    struct _LinkList* prevNode;
+    size_t prevSize;
+    size_t head;
+    struct _LinkList* prevNode; // Neighbours in the free list, free nodes only
     struct _LinkList* nextNode;
-    size_t size;
-    int isFree;
-    void* address;
+    struct _LinkList* prevBin; // Neighbours in the size class bin, free nodes only
+    struct _LinkList* nextBin;
 }LinkList;
 
+// Requests of up to SLAB_MAX_SIZE bytes come from page sized slabs of equal
+// objects without any header. All slabs lie in one reserved region, so a
+// pointer inside it is a slab object and its slab is found by masking.
+#define SLAB_SIZE 4096
+#define SLAB_STEP 16
+#define SLAB_MAX_SIZE 256
+#define SLAB_CLASSES (SLAB_MAX_SIZE / SLAB_STEP)
+#define SLAB_BITMAP_WORDS (SLAB_SIZE / SLAB_STEP / 64)
+#define SLAB_REGION_SIZE (1UL << 30)
+
+typedef struct _Slab{
+    struct _Slab* prevSlab; // Neighbours in the heap's list of slabs with free objects
+    struct _Slab* nextSlab;
+    unsigned long heapId;
+    unsigned int objectSize;
+    unsigned int capacity;
+    unsigned int freeCount;
+    unsigned long bitmap[SLAB_BITMAP_WORDS]; // Bit set for a free object
+}Slab;
+
+// Locks of the arenas and of the state shared by all heaps, one kind per
+// process: TS_LOCK in the environment, or TS_LOCK_DEFAULT at build time.
+// Spinning waiters yield every LOCK_SPIN_YIELD spins, or on every spin on
+// a single CPU where the holder cannot run while they spin.
+#define TS_LOCK_PTHREAD 0 // pthread mutex
+#define TS_LOCK_TICKET 1 // Ticket spinlock, FIFO
+#define TS_LOCK_MCS 2 // MCS queue lock, each waiter spins on its own node
+#define TS_LOCK_ADAPTIVE 3 // Spin for about as long as recent waits took, then futex sleep
+#ifndef TS_LOCK_DEFAULT
+#define TS_LOCK_DEFAULT TS_LOCK_PTHREAD
+#endif
+#define LOCK_SPIN_YIELD 128
+#define LOCK_SPIN_MAX 1000 // Adaptive spins before sleeping
+#define MCS_NODES (MAX_ARENAS + 4) // Per thread, one per lock held or awaited
+
+typedef struct _MCSNode{
+    struct _MCSNode* next;
+    int locked;
+    int inUse;
+}MCSNode;
+
+// The counters are written by the holder only
+typedef struct _LockStats{
+    unsigned long acquired;
+    unsigned long contended; // Acquisitions that found the lock held
+    unsigned long spins; // Busy wait iterations of those
+    unsigned long sleeps; // Futex sleeps and yields of those
+}LockStats;
+
+typedef struct _TsLock{
+    pthread_mutex_t mutex; // TS_LOCK_PTHREAD
+    unsigned int nextTicket; // TS_LOCK_TICKET
+    unsigned int serving;
+    MCSNode* tail; // TS_LOCK_MCS
+    MCSNode* holder;
+    int futex; // TS_LOCK_ADAPTIVE: 0 free, 1 held, 2 held with sleepers
+    int spinAvg; // Smoothed spins of contended acquisitions
+    LockStats stats;
+}TsLock;
+
+#define TS_LOCK_INITIALIZER {.mutex = PTHREAD_MUTEX_INITIALIZER, .nextTicket = 0, .serving = 0, \
+        .tail = NULL, .holder = NULL, .futex = 0, .spinAvg = 0, .stats = {0, 0, 0, 0}}
+
+// A heap is only changed by the thread that owns it (or under its lock for
+// the arenas). Other threads hand blocks back through remoteHead, a lock free
+// stack chained through the payloads that the owner empties on its next malloc.
+typedef struct _Heap{
+    LinkList* headNode; // LIFO free list
+    unsigned long freeNodes; // Length of the free list
+    unsigned long id;
+    void* segmentEnd; // End of the latest sbrk() segment of this heap
+    void* freshStart; // The latest segment was never handed out past this
+    size_t growSize; // Size of the next sbrk() chunk
+    unsigned long dirtyBytes; // Freed since the last purge
+    long dirtySince; // Time in ms of the first free since the last purge
+    void* remoteHead;
+    int owned; // Cleared when the owning thread exits, the heap is then adopted
+    TsLock lock; // Arenas of the locked version only
+    unsigned long mallocCount; // Lock acquisitions to allocate, arenas only
+    unsigned long freeCount;
+    unsigned long contendedCount; // Times the arena was found locked
+    unsigned long flBitmap; // Bit fl set when slBitmap[fl] != 0
+    unsigned int slBitmap[FL_INDEX_COUNT];
+    LinkList* bins[FL_INDEX_COUNT][SL_INDEX_COUNT];
+    Slab* slabs[SLAB_CLASSES];
+    unsigned long dataSegmentSize;
+    unsigned long freeSpaceSize;
+}Heap;
+
+// Batch allocations carve blocks above the slab sizes out of nodes of at
+// most this many bytes
+#define BATCH_CARVE_BYTES (64 * 1024)
+
+// The arenas of the locked version and the heaps of the nolock version
+// share one table
+#define MAX_HEAPS 1024
+#define MAX_ARENAS 64
+
+// Per-thread cache of small blocks in front of the locked heap, one bin per
+// TCACHE_STEP bytes of size up to TCACHE_MAX_SIZE
+#define TCACHE_STEP 16
+#define TCACHE_MAX_SIZE 1024
+#define TCACHE_BINS (TCACHE_MAX_SIZE / TCACHE_STEP)
+#define TCACHE_FILL 16
+#define TCACHE_FILL_BYTES 4096 // Larger bins refill fewer nodes at a time
+#define TCACHE_DEFAULT_BYTES (256 * 1024)
+
+typedef struct _ThreadCache{
+    void* bins[TCACHE_BINS]; // Cached blocks stay allocated, chained through the payload
+    unsigned int counts[TCACHE_BINS];
+    size_t bytes;
+}ThreadCache;
+
+// Lock free pool between the thread caches of the locking version: full
+// batches of CENTRAL_BATCH slab objects in one Treiber stack per slab class.
+// The first object of a batch links the next batch through its second word.
+// A stack head holds the offset of the top batch in the slab region and a
+// tag in the bits above it that changes with every push and pop, so that a
+// pop cannot succeed on a batch that was taken and pushed again meanwhile.
+#define CENTRAL_BATCH TCACHE_FILL
+#define CENTRAL_MAX_BYTES (512 * 1024) // Per class, further blocks go to the arenas
+#define CENTRAL_OFFSET_MASK (SLAB_REGION_SIZE - 1)
+#define CENTRAL_TAG_ONE SLAB_REGION_SIZE
+
+// Optional per-CPU cache of slab objects in front of the thread caches of
+// the locking version. A thread pushes and pops the cache of the CPU it
+// runs on inside a restartable sequence (rseq): no atomics, the kernel
+// restarts the sequence when the thread is preempted or migrated before
+// the store that commits it. Half a class is refilled from the central
+// pool or an arena and flushed back at a time.
+#define CPU_CACHE_SLOTS 32 // Objects per class and CPU
+#define CPU_CACHE_FILL (CPU_CACHE_SLOTS / 2)
+#define CPU_CACHE_MAX_CPUS 1024 // Higher CPU numbers use the thread cache
+#define RSEQ_SIG 0x53053053
+
+// A refill takes a whole pool batch into one CPU_CACHE_FILL array
+_Static_assert(CENTRAL_BATCH <= CPU_CACHE_FILL, "a central pool batch must fit a CPU cache refill");
+
+typedef struct _CpuCache{
+    unsigned long counts[SLAB_CLASSES];
+    void* slots[SLAB_CLASSES][CPU_CACHE_SLOTS]; // Cached objects stay allocated
+}CpuCache;
+
+// Allocation modes, selected with ts_mallopt(TS_M_MODE, ...) or the
+// TS_MALLOC_MODE environment variable ("first-fit" or "segregated")
+#define TS_MODE_FIRST_FIT 0
+#define TS_MODE_SEGREGATED 1
+
+// Requests of at least the mmap threshold get their own mapping. Unless it
+// is set explicitly the threshold follows the largest mapped node freed so
+// far, up to MMAP_THRESHOLD_MAX, like glibc's sliding threshold.
+#define MMAP_THRESHOLD_DEFAULT (128 * 1024)
+#define MMAP_THRESHOLD_MAX (32 * 1024 * 1024)
+
+// Heaps grow by chunks of at least the current grow size, which starts at
+// the TS_M_GROW_MIN value and doubles with every chunk up to GROW_MAX
+#define GROW_MIN_DEFAULT (128 * 1024)
+#define GROW_MAX (4 * 1024 * 1024)
+
+// Memory goes back to the kernel in two ways: a free node of at least the
+// trim threshold at the end of the brk heap is cut off with brk(), and once
+// PURGE_MIN_DIRTY bytes were freed the pages inside large free nodes are
+// dropped with madvise() once the first of those frees is a decay period
+// old, checked on the heap's next malloc or free. Trimming needs the
+// break to itself, so only builds that are the process's malloc set
+// TS_OWN_BRK (the preload library). Elsewhere glibc malloc moves the break
+// too and only purging gives memory back.
+#ifndef TS_OWN_BRK
+#define TS_OWN_BRK 0
+#endif
+#define TRIM_THRESHOLD_DEFAULT (128 * 1024)
+#define PURGE_DECAY_DEFAULT_MS 10000
+#define PURGE_MIN_DIRTY (1024 * 1024)
+
+// Thread to arena binding, set with TS_ARENA_POLICY ("rr" or "cpu")
+#define TS_ARENA_ROUND_ROBIN 0
+#define TS_ARENA_CPU 1
+
+// Allocator statistics, counted while TS_STATS or TS_STATS_DUMP is set in the
+// environment or after ts_mallopt(TS_M_STATS, 1)
+typedef struct _MallocStats{
+    unsigned long mallocCalls;
+    unsigned long freeCalls;
+    unsigned long allocatedBytes; // Usable bytes of the blocks handed out
+    unsigned long freedBytes;
+    long bytesInUse; // Negative for a thread that freed others' blocks
+    unsigned long sbrkCalls;
+    unsigned long mmapCalls; // mmap() and mremap()
+    unsigned long munmapCalls;
+    unsigned long searches; // Free list or bin lookups
+    unsigned long nodesScanned; // Free nodes looked at by those lookups
+    unsigned long lockAcquired;
+    unsigned long lockContended; // Acquisitions that had to wait
+    unsigned long lockWaitNs; // Time spent waiting for them
+    unsigned long freeListLength; // Heap wide, sampled when read
+    unsigned long dataSegmentSize;
+    unsigned long freeSpaceSize;
+}MallocStats;
+
+// Counters of one thread, on their own cache lines so that only the owner
+// writes to them. Slots are reused once their thread exits.
+#define STAT_SLOTS 1024
+
+typedef struct _StatSlot{
+    MallocStats stats;
+    int inUse;
+    int tid;
+}__attribute__((aligned(64))) StatSlot;
+
+// Allocation trace, recorded while TS_TRACE names a file. Each thread
+// buffers its events and appends them to the file when the buffer fills,
+// when the thread exits and at process exit. The file starts with
+// TRACE_MAGIC followed by the events of all threads.
+#define TRACE_MAGIC 0x3145434152545354UL // "TSTRACE1"
+#define TRACE_MALLOC 1
+#define TRACE_FREE 2
+#define TRACE_REALLOC 3
+#define TRACE_ALIGNED 4
+#define TRACE_BUFFER_EVENTS 4096
+
+// Block addresses are the object ids. seq orders the events of all threads,
+// it is taken after a block is obtained and before it is released, so no
+// address is live twice at the same point of the order.
+typedef struct _TraceEvent{
+    unsigned long seq;
+    unsigned long releaseSeq; // Realloc only, taken before the old block is released
+    unsigned long timeNs; // Since tracing started
+    unsigned long object; // Block returned, or released by TRACE_FREE
+    unsigned long arg; // Old block of a realloc, alignment of TRACE_ALIGNED
+    unsigned long size;
+    unsigned int tid;
+    unsigned int op;
+}TraceEvent;
+
+typedef struct _TraceBuffer{
+    TraceEvent events[TRACE_BUFFER_EVENTS];
+    unsigned int count;
+    unsigned int tid;
+    int inUse; // Buffers are reused once their thread exits
+    struct _TraceBuffer* next; // All buffers, never removed
+}TraceBuffer;
+
+// ts_mallopt() parameters
+#define TS_M_MODE 1
+#define TS_M_TCACHE_BYTES 2 // Per-thread cache cap in bytes, 0 disables it
+#define TS_M_MMAP_THRESHOLD 3 // Smallest request served by mmap() in bytes
+#define TS_M_GROW_MIN 4 // First sbrk() chunk of a heap in bytes
+#define TS_M_TRIM_THRESHOLD 5 // Free heap end that triggers trimming, < 0 disables
+#define TS_M_PURGE_DECAY_MS 6 // Minimum time between purges, < 0 disables
+#define TS_M_STATS 7 // 1 turns statistics on, 0 off
+#define TS_M_CENTRAL_POOL 8 // 1 exchanges cache batches lock free, 0 under the arena locks
+#define TS_M_CPU_CACHE 9 // 1 caches slab objects per CPU where rseq is available, 0 per thread
+
 //Thread Safe malloc/free: locking version
 void *ts_malloc_lock(size_t size);
 void ts_free_lock(void *ptr);
@@ -21,4 +303,66 @@ void ts_free_lock(void *ptr);
 void *ts_malloc_nolock(size_t size);
 void ts_free_nolock(void *ptr);
 
+// Free a block whose requested size, or any size up to its usable size,
+// the caller knows. The locking version then puts small blocks into the
+// thread cache without reading their header. The nolock version has no
+// cache and skips the mapping check of small blocks.
+void ts_free_sized_lock(void *ptr, size_t size);
+void ts_free_sized_nolock(void *ptr, size_t size);
+
+// calloc() and realloc() for both versions. realloc grows a node into a
+// free neighbour or shrinks it in place and only copies when it must.
+void *ts_calloc_lock(size_t nmemb, size_t size);
+void *ts_realloc_lock(void *ptr, size_t size);
+void *ts_calloc_nolock(size_t nmemb, size_t size);
+void *ts_realloc_nolock(void *ptr, size_t size);
+
+// Allocations aligned to a power of two, freed with the ts_free_* of the
+// same version. ts_aligned_alloc_* returns NULL for a bad alignment and
+// ts_posix_memalign_* returns EINVAL or ENOMEM like posix_memalign().
+void *ts_aligned_alloc_lock(size_t alignment, size_t size);
+int ts_posix_memalign_lock(void **memptr, size_t alignment, size_t size);
+void *ts_aligned_alloc_nolock(size_t alignment, size_t size);
+int ts_posix_memalign_nolock(void **memptr, size_t alignment, size_t size);
+
+// Allocate n blocks of size bytes each into out under one lock acquisition,
+// carving blocks above the slab sizes out of one free region per
+// BATCH_CARVE_BYTES. Returns how many were allocated, the rest of out is
+// NULL. ts_free_batch_* sorts ptrs in place and frees each run of blocks of
+// one heap together, merging neighbours before they are coalesced with the
+// free space. Blocks of a batch may also be freed one by one and the other
+// way round.
+size_t ts_malloc_batch_lock(size_t size, size_t n, void **out);
+void ts_free_batch_lock(void **ptrs, size_t n);
+size_t ts_malloc_batch_nolock(size_t size, size_t n, void **out);
+void ts_free_batch_nolock(void **ptrs, size_t n);
+
+// Set an allocator parameter, returns 1 on success and 0 on a bad value
+int ts_mallopt(int param, int value);
+
+// Return free memory to the kernel, keeping pad bytes at the end of each
+// heap. Returns 1 if any memory was released.
+int ts_malloc_trim(size_t pad);
+
+// Statistics of the calling thread, or summed over all threads including
+// exited ones. The heap wide fields are those of the caller's nolock heap
+// for the thread and of all heaps for the total.
+void ts_malloc_stats_thread(MallocStats *stats);
+void ts_malloc_stats_total(MallocStats *stats);
+// Print one line per live thread and the total
+void ts_malloc_stats_print(FILE *out);
+
+// Lock kind in use ("pthread", "ticket", "mcs" or "adaptive") and its
+// counters summed over the arenas and the shared lock
+const char *ts_malloc_lock_name(void);
+void ts_malloc_lock_stats(LockStats *stats);
+
+// Usable payload bytes of an allocated block of either version
+size_t ts_malloc_usable_size(void *ptr);
+
+// Take every allocator lock before fork() and release them in the parent
+// and the child afterwards, for pthread_atfork()
+void ts_malloc_prefork(void);
+void ts_malloc_postfork(void);
+
 #endif
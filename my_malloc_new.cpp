@@ -0,0 +1,132 @@
+// C++ operator new and delete for the preload library, on top of the
+// malloc and free it defines
+#include <new>
+#include <cstdlib>
+#include <malloc.h>
+
+// Defined by the preload library, C23 declares it in <stdlib.h>
+extern "C" void free_sized(void* ptr, std::size_t size) noexcept;
+
+static void* allocate(std::size_t size) {
+    void* ptr;
+    while ((ptr = malloc(size)) == NULL) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ptr;
+}
+
+static void* allocateAligned(std::size_t size, std::align_val_t alignment) {
+    void* ptr;
+    while ((ptr = aligned_alloc(static_cast<std::size_t>(alignment), size)) == NULL) {
+        std::new_handler handler = std::get_new_handler();
+        if (handler == NULL) {
+            throw std::bad_alloc();
+        }
+        handler();
+    }
+    return ptr;
+}
+
+void* operator new(std::size_t size) {
+    return allocate(size);
+}
+
+void* operator new[](std::size_t size) {
+    return allocate(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return allocate(size);
+    }
+    catch (...) {
+        return NULL;
+    }
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+    try {
+        return allocate(size);
+    }
+    catch (...) {
+        return NULL;
+    }
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment) {
+    return allocateAligned(size, alignment);
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment) {
+    return allocateAligned(size, alignment);
+}
+
+void* operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return allocateAligned(size, alignment);
+    }
+    catch (...) {
+        return NULL;
+    }
+}
+
+void* operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t&) noexcept {
+    try {
+        return allocateAligned(size, alignment);
+    }
+    catch (...) {
+        return NULL;
+    }
+}
+
+void operator delete(void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t size) noexcept {
+    free_sized(ptr, size);
+}
+
+void operator delete[](void* ptr, std::size_t size) noexcept {
+    free_sized(ptr, size);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t, std::align_val_t) noexcept {
+    free(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept {
+    free(ptr);
+}
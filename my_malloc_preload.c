@@ -0,0 +1,199 @@
+// Drop-in malloc/free for LD_PRELOAD on top of the thread safe allocator.
+// The locking version is used unless built with -DNOLOCK_VERSION.
+#define _GNU_SOURCE
+#include "my_malloc.h"
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <malloc.h>
+
+#ifdef NOLOCK_VERSION
+#define TS_MALLOC ts_malloc_nolock
+#define TS_FREE ts_free_nolock
+#define TS_FREE_SIZED ts_free_sized_nolock
+#define TS_CALLOC ts_calloc_nolock
+#define TS_REALLOC ts_realloc_nolock
+#define TS_ALIGNED_ALLOC ts_aligned_alloc_nolock
+#else
+#define TS_MALLOC ts_malloc_lock
+#define TS_FREE ts_free_lock
+#define TS_FREE_SIZED ts_free_sized_lock
+#define TS_CALLOC ts_calloc_lock
+#define TS_REALLOC ts_realloc_lock
+#define TS_ALIGNED_ALLOC ts_aligned_alloc_lock
+#endif
+
+// Allocations made while the allocator itself runs (glibc may allocate in
+// the pthread calls it makes) come from a static buffer and are never
+// freed. Each one is preceded by its size.
+#define BOOTSTRAP_SIZE (64 * 1024)
+
+static char bootstrap[BOOTSTRAP_SIZE] __attribute__((aligned(16)));
+static size_t bootstrapUsed = 0;
+static __thread int inAllocator = 0;
+
+static void* bootstrapMalloc(size_t size) {
+    size_t total = ((size + 15) & ~(size_t)15) + 16;
+    if (size > BOOTSTRAP_SIZE) {
+        return NULL;
+    }
+    size_t offset = __atomic_fetch_add(&bootstrapUsed, total, __ATOMIC_RELAXED);
+    if (offset + total > BOOTSTRAP_SIZE) {
+        return NULL;
+    }
+    *(size_t*)(bootstrap + offset) = total - 16;
+    return bootstrap + offset + 16;
+}
+
+static int isBootstrap(void* ptr) {
+    return (char*)ptr >= bootstrap && (char*)ptr < bootstrap + BOOTSTRAP_SIZE;
+}
+
+static size_t usableSize(void* ptr) {
+    return isBootstrap(ptr) ? *(size_t*)((char*)ptr - 16) : ts_malloc_usable_size(ptr);
+}
+
+__attribute__((constructor)) static void initPreload(void) {
+    pthread_atfork(ts_malloc_prefork, ts_malloc_postfork, ts_malloc_postfork);
+}
+
+void* malloc(size_t size) {
+    if (inAllocator) {
+        return bootstrapMalloc(size);
+    }
+    inAllocator = 1;
+    // malloc(0) has to return a pointer that can be freed
+    void* res = TS_MALLOC((size == 0) ? 1 : size);
+    inAllocator = 0;
+    if (res == NULL) {
+        errno = ENOMEM;
+    }
+    return res;
+}
+
+void free(void* ptr) {
+    // Nested frees can only come from inside the allocator, leave them
+    if (ptr == NULL || isBootstrap(ptr) || inAllocator) {
+        return;
+    }
+    inAllocator = 1;
+    TS_FREE(ptr);
+    inAllocator = 0;
+}
+
+// C23, also used by the sized operator delete
+void free_sized(void* ptr, size_t size) {
+    if (ptr == NULL || isBootstrap(ptr) || inAllocator) {
+        return;
+    }
+    inAllocator = 1;
+    TS_FREE_SIZED(ptr, size);
+    inAllocator = 0;
+}
+
+void* calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (inAllocator) {
+        return bootstrapMalloc(nmemb * size); // Static memory is still zero
+    }
+    inAllocator = 1;
+    void* res = TS_CALLOC((nmemb * size == 0) ? 1 : nmemb, (nmemb * size == 0) ? 1 : size);
+    inAllocator = 0;
+    if (res == NULL) {
+        errno = ENOMEM;
+    }
+    return res;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (ptr == NULL) {
+        return malloc(size);
+    }
+    if (isBootstrap(ptr) || inAllocator) {
+        // Move bootstrap blocks into the allocator
+        void* res = malloc(size);
+        if (res != NULL) {
+            size_t oldSize = usableSize(ptr);
+            memcpy(res, ptr, (oldSize < size) ? oldSize : size);
+            free(ptr);
+        }
+        return res;
+    }
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    inAllocator = 1;
+    void* res = TS_REALLOC(ptr, size);
+    inAllocator = 0;
+    if (res == NULL) {
+        errno = ENOMEM;
+    }
+    return res;
+}
+
+void* reallocarray(void* ptr, size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return realloc(ptr, nmemb * size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size) {
+    if ((alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (inAllocator) {
+        return (alignment <= 16) ? bootstrapMalloc(size) : NULL;
+    }
+    inAllocator = 1;
+    void* res = TS_ALIGNED_ALLOC(alignment, (size == 0) ? 1 : size);
+    inAllocator = 0;
+    if (res == NULL) {
+        errno = ENOMEM;
+    }
+    return res;
+}
+
+void* memalign(size_t alignment, size_t size) {
+    return aligned_alloc(alignment, size);
+}
+
+int posix_memalign(void** memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    int saved = errno;
+    void* res = aligned_alloc(alignment, size);
+    if (res == NULL) {
+        errno = saved;
+        return ENOMEM;
+    }
+    *memptr = res;
+    return 0;
+}
+
+void* valloc(size_t size) {
+    return aligned_alloc(sysconf(_SC_PAGESIZE), size);
+}
+
+void* pvalloc(size_t size) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return aligned_alloc(page, (size + page - 1) & ~(page - 1));
+}
+
+int malloc_trim(size_t pad) {
+    inAllocator = 1;
+    int res = ts_malloc_trim(pad);
+    inAllocator = 0;
+    return res;
+}
+
+size_t malloc_usable_size(void* ptr) {
+    return (ptr == NULL) ? 0 : usableSize(ptr);
+}
@@ -0,0 +1,279 @@
+#include <math.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include "my_malloc.h"
+#include "bench_common.h"
+
+static void central_pool_on(void) {
+  ts_mallopt(TS_M_CPU_CACHE, 0);
+  ts_mallopt(TS_M_CENTRAL_POOL, 1);
+}
+
+static void central_pool_off(void) {
+  ts_mallopt(TS_M_CPU_CACHE, 0);
+  ts_mallopt(TS_M_CENTRAL_POOL, 0);
+}
+
+static void cpu_cache_on(void) {
+  ts_mallopt(TS_M_CENTRAL_POOL, 1);
+  ts_mallopt(TS_M_CPU_CACHE, 1);
+}
+
+const allocator_t allocators[] = {
+  {"lock", ts_malloc_lock, ts_free_lock, ts_realloc_lock, ts_aligned_alloc_lock, central_pool_on},
+  {"lock-mutex", ts_malloc_lock, ts_free_lock, ts_realloc_lock, ts_aligned_alloc_lock, central_pool_off},
+  {"lock-cpu", ts_malloc_lock, ts_free_lock, ts_realloc_lock, ts_aligned_alloc_lock, cpu_cache_on},
+  {"nolock", ts_malloc_nolock, ts_free_nolock, ts_realloc_nolock, ts_aligned_alloc_nolock, NULL},
+  {"glibc", malloc, free, realloc, aligned_alloc, NULL},
+  {NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+const allocator_t *find_allocator(const char *name) {
+  for (int i = 0; allocators[i].name != NULL; i++) {
+    if (strcmp(allocators[i].name, name) == 0) {
+      if (allocators[i].setup_fn != NULL) {
+        allocators[i].setup_fn();
+      }
+      return &allocators[i];
+    }
+  }
+  return NULL;
+}
+
+int parse_size_dist(const char *spec, size_dist_t *dist) {
+  char kind[16];
+  unsigned long a, b;
+  double x;
+  if (sscanf(spec, "%15[a-z]", kind) != 1) {
+    return 0;
+  }
+  const char *args = spec + strlen(kind);
+  memset(dist, 0, sizeof(*dist));
+  if (strcmp(kind, "uniform") == 0 && sscanf(args, ":%lu:%lu", &a, &b) == 2 && a >= 1 && a <= b) {
+    dist->kind = DIST_UNIFORM;
+    dist->min = a;
+    dist->max = b;
+    return 1;
+  }
+  if (strcmp(kind, "lognormal") == 0 && sscanf(args, ":%lu:%lf", &a, &x) == 2 && a >= 1 && x >= 0) {
+    dist->kind = DIST_LOGNORMAL;
+    dist->min = a;
+    dist->sigma = x;
+    return 1;
+  }
+  if (strcmp(kind, "bimodal") == 0 && sscanf(args, ":%lu:%lu:%lf", &a, &b, &x) == 3 && a >= 1 && a <= b && x >= 0 && x <= 1) {
+    dist->kind = DIST_BIMODAL;
+    dist->min = a;
+    dist->max = b;
+    dist->ratio = x;
+    return 1;
+  }
+  return 0;
+}
+
+void format_size_dist(const size_dist_t *dist, char *buf, size_t len) {
+  if (dist->kind == DIST_UNIFORM) {
+    snprintf(buf, len, "uniform:%zu:%zu", dist->min, dist->max);
+  } else if (dist->kind == DIST_LOGNORMAL) {
+    snprintf(buf, len, "lognormal:%zu:%g", dist->min, dist->sigma);
+  } else {
+    snprintf(buf, len, "bimodal:%zu:%zu:%g", dist->min, dist->max, dist->ratio);
+  }
+}
+
+static int draw(unsigned *seed) {
+  return (seed != NULL) ? rand_r(seed) : rand();
+}
+
+static double uniform01(unsigned *seed) {
+  return (draw(seed) + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+size_t next_size(const size_dist_t *dist) {
+  return next_size_r(dist, NULL);
+}
+
+size_t next_size_r(const size_dist_t *dist, unsigned *seed) {
+  if (dist->kind == DIST_UNIFORM) {
+    // The original measurement test: 4 to 32 chunks of 32 bytes
+    const unsigned chunk_size = 32;
+    unsigned min_chunks = (dist->min + chunk_size - 1) / chunk_size;
+    unsigned max_chunks = dist->max / chunk_size;
+    if (max_chunks < min_chunks) {
+      return dist->min;
+    }
+    unsigned num_chunks = (draw(seed) % (max_chunks - min_chunks + 1)) + min_chunks;
+    return num_chunks * chunk_size;
+  }
+  if (dist->kind == DIST_LOGNORMAL) {
+    // Box-Muller for a standard normal draw
+    double z = sqrt(-2.0 * log(uniform01(seed))) * cos(2.0 * M_PI * uniform01(seed));
+    double size = dist->min * exp(dist->sigma * z);
+    return (size < 1) ? 1 : (size > (1 << 20)) ? (1 << 20) : (size_t)size;
+  }
+  size_t max = (uniform01(seed) < dist->ratio) ? dist->max : dist->min;
+  return 1 + draw(seed) % max;
+}
+
+int parse_format(const char *name) {
+  if (strcmp(name, "text") == 0) {
+    return FORMAT_TEXT;
+  }
+  if (strcmp(name, "json") == 0) {
+    return FORMAT_JSON;
+  }
+  if (strcmp(name, "csv") == 0) {
+    return FORMAT_CSV;
+  }
+  return -1;
+}
+
+void hist_merge(histogram_t *total, const histogram_t *hist) {
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    total->counts[i] += hist->counts[i];
+  }
+  total->total += hist->total;
+  total->sum += hist->sum;
+  if (hist->max > total->max) {
+    total->max = hist->max;
+  }
+}
+
+unsigned long hist_percentile(const histogram_t *hist, double p) {
+  unsigned long target = (unsigned long)ceil(p * hist->total);
+  unsigned long seen = 0;
+  if (target == 0) {
+    target = 1;
+  }
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    seen += hist->counts[i];
+    if (seen >= target) {
+      // Report the top of the bucket, but never more than the maximum
+      unsigned long top = i;
+      if (i >= HIST_SUB) {
+        int shift = i / HIST_SUB - 1;
+        top = ((unsigned long)(i % HIST_SUB + HIST_SUB + 1) << shift) - 1;
+      }
+      return (top < hist->max) ? top : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+const char *perf_event_names[PERF_EVENTS] = {
+  "cycles", "instructions", "l1d_misses", "llc_misses", "dtlb_misses", "context_switches", "page_faults"
+};
+
+#define HW_CACHE_MISS(cache) \
+  ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct {
+  unsigned int type;
+  unsigned long config;
+} perf_events[PERF_EVENTS] = {
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+  {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+  {PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_L1D)},
+  {PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_LL)},
+  {PERF_TYPE_HW_CACHE, HW_CACHE_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+  {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+};
+
+int perf_open(perf_counters_t *counters) {
+  int opened = 0;
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[i].type;
+    attr.config = perf_events[i].config;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // Software events happen in the kernel, so try with it first. User
+    // space only is what perf_event_paranoid 2 still allows.
+    attr.exclude_kernel = (perf_events[i].type != PERF_TYPE_SOFTWARE);
+    attr.exclude_hv = 1;
+    counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    if (counters->fds[i] < 0 && !attr.exclude_kernel) {
+      attr.exclude_kernel = 1;
+      counters->fds[i] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+    }
+    if (counters->fds[i] >= 0) {
+      opened++;
+    }
+  }
+  return opened;
+}
+
+void perf_read(const perf_counters_t *counters, perf_values_t *values) {
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    unsigned long data[3]; // value, time enabled, time running
+    values->values[i] = -1;
+    if (counters->fds[i] < 0 || read(counters->fds[i], data, sizeof(data)) != sizeof(data)) {
+      continue;
+    }
+    // Scale up counts of a counter that was multiplexed out part of the time
+    values->values[i] = (data[2] > 0 && data[2] < data[1]) ? (double)data[0] * data[1] / data[2] : (double)data[0];
+  }
+}
+
+void perf_close(perf_counters_t *counters) {
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    if (counters->fds[i] >= 0) {
+      close(counters->fds[i]);
+      counters->fds[i] = -1;
+    }
+  }
+}
+
+void perf_diff(const perf_values_t *start, const perf_values_t *end, perf_values_t *diff) {
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    diff->values[i] = (start->values[i] < 0 || end->values[i] < 0) ? -1 : end->values[i] - start->values[i];
+  }
+}
+
+void perf_add(perf_values_t *total, const perf_values_t *values) {
+  for (int i = 0; i < PERF_EVENTS; i++) {
+    total->values[i] = (total->values[i] < 0 || values->values[i] < 0) ? -1 : total->values[i] + values->values[i];
+  }
+}
+
+double calc_time(struct timespec start, struct timespec end) {
+  double start_sec = (double)start.tv_sec*1000000000.0 + (double)start.tv_nsec;
+  double end_sec = (double)end.tv_sec*1000000000.0 + (double)end.tv_nsec;
+
+  if (end_sec < start_sec) {
+    return 0;
+  } else {
+    return end_sec - start_sec;
+  }
+}
+
+double now_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec*1000000000.0 + (double)now.tv_nsec;
+}
+
+// Resident bytes from /proc/self/statm, 0 where it cannot be read
+long current_rss(void) {
+  long size = 0, pages = 0;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == NULL) {
+    return 0;
+  }
+  if (fscanf(statm, "%ld %ld", &size, &pages) != 2) {
+    pages = 0;
+  }
+  fclose(statm);
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+long peak_rss(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss * 1024;
+}
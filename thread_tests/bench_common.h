@@ -0,0 +1,127 @@
+#ifndef BENCH_COMMON_H
+#define BENCH_COMMON_H
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Helpers shared by the benchmark drivers in this directory
+
+// Allocators a benchmark can run against in one binary. "lock-mutex" is
+// the locking version with the central pool turned off, "lock-cpu" the
+// one with the per-CPU cache turned on.
+typedef struct allocator {
+  const char *name;
+  void *(*malloc_fn)(size_t size);
+  void (*free_fn)(void *ptr);
+  void *(*realloc_fn)(void *ptr, size_t size);
+  void *(*aligned_fn)(size_t alignment, size_t size);
+  void (*setup_fn)(void); // Applies the allocator's settings, may be NULL
+} allocator_t;
+
+extern const allocator_t allocators[];
+// Look up an allocator by name and apply its settings
+const allocator_t *find_allocator(const char *name);
+
+// The allocator a test built with -DLOCK_VERSION or -DNOLOCK_VERSION uses
+#ifdef LOCK_VERSION
+#define DEFAULT_ALLOCATOR "lock"
+#else
+#define DEFAULT_ALLOCATOR "nolock"
+#endif
+
+// Request size distributions:
+//   uniform:<min>:<max>           32 byte chunks between min and max bytes
+//   lognormal:<median>:<sigma>    log-normal around median, up to 1 MB
+//   bimodal:<small>:<large>:<p>   up to small bytes, or up to large bytes
+//                                 with probability p
+enum { DIST_UNIFORM, DIST_LOGNORMAL, DIST_BIMODAL };
+
+typedef struct size_dist {
+  int kind;
+  size_t min;
+  size_t max;
+  double sigma;
+  double ratio;
+} size_dist_t;
+
+int parse_size_dist(const char *spec, size_dist_t *dist);
+void format_size_dist(const size_dist_t *dist, char *buf, size_t len);
+// Draws from rand(), seed it with srand() for repeatable runs
+size_t next_size(const size_dist_t *dist);
+// Draws from rand_r(seed), for use from several threads
+size_t next_size_r(const size_dist_t *dist, unsigned *seed);
+
+// Output formats of the benchmark results
+enum { FORMAT_TEXT, FORMAT_JSON, FORMAT_CSV };
+int parse_format(const char *name);
+
+// Log bucketed latency histogram in the style of HdrHistogram: every power
+// of two range is split into HIST_SUB linear buckets, so a recorded value
+// is off by at most 1/HIST_SUB of itself
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct histogram {
+  unsigned long counts[HIST_BUCKETS];
+  unsigned long total;
+  unsigned long max;
+  double sum;
+} histogram_t;
+
+static inline void hist_record(histogram_t *hist, unsigned long value) {
+  int index = value;
+  if (value >= HIST_SUB) {
+    int shift = 63 - __builtin_clzl(value) - HIST_SUB_BITS;
+    index = (shift + 1) * HIST_SUB + (int)((value >> shift) - HIST_SUB);
+  }
+  hist->counts[index]++;
+  hist->total++;
+  hist->sum += value;
+  if (value > hist->max) {
+    hist->max = value;
+  }
+}
+
+void hist_merge(histogram_t *total, const histogram_t *hist);
+// Smallest value that at least a fraction p of the values are at or below
+unsigned long hist_percentile(const histogram_t *hist, double p);
+
+// Optional hardware and software counters of the calling thread through
+// perf_event_open(). Counters the kernel or the container does not offer
+// stay closed and read as unavailable, hardware ones count user space only.
+enum {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_DTLB_MISSES,
+  PERF_CONTEXT_SWITCHES,
+  PERF_PAGE_FAULTS,
+  PERF_EVENTS
+};
+extern const char *perf_event_names[PERF_EVENTS];
+
+typedef struct perf_counters {
+  int fds[PERF_EVENTS];
+} perf_counters_t;
+
+// Counts scaled for multiplexing, -1 where a counter is unavailable
+typedef struct perf_values {
+  double values[PERF_EVENTS];
+} perf_values_t;
+
+// Returns the number of counters opened for the calling thread
+int perf_open(perf_counters_t *counters);
+void perf_read(const perf_counters_t *counters, perf_values_t *values);
+void perf_close(perf_counters_t *counters);
+// end - start, or accumulate into total, keeping unavailable counters at -1
+void perf_diff(const perf_values_t *start, const perf_values_t *end, perf_values_t *diff);
+void perf_add(perf_values_t *total, const perf_values_t *values);
+
+double calc_time(struct timespec start, struct timespec end);
+double now_ns(void);
+long current_rss(void);
+long peak_rss(void);
+
+#endif
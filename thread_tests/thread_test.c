@@ -1,20 +1,29 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
 #include "my_malloc.h"
+#include "verify.h"
 
 #ifdef LOCK_VERSION
 #define MALLOC(sz) ts_malloc_lock(sz)
 #define FREE(p)    ts_free_lock(p)
+#define REALLOC(p, sz) ts_realloc_lock(p, sz)
+#define ALIGNED_ALLOC(a, sz) ts_aligned_alloc_lock(a, sz)
 #endif
 #ifdef NOLOCK_VERSION
 #define MALLOC(sz) ts_malloc_nolock(sz)
 #define FREE(p)    ts_free_nolock(p)
+#define REALLOC(p, sz) ts_realloc_nolock(p, sz)
+#define ALIGNED_ALLOC(a, sz) ts_aligned_alloc_nolock(a, sz)
 #endif
 
 #define NUM_THREADS  4
 #define NUM_ITEMS    10000
+#define NUM_ALIGNED  64
+#define CACHE_LINE   64
 
 pthread_t threads[NUM_THREADS];
 int       thread_id[NUM_THREADS];
@@ -43,6 +52,7 @@ void do_allocate(int thread_id) {
   for (i=0; i < NUM_ITEMS; i++) {
     index = i + thread_start_index;
     malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    verify_fill(malloc_items[index].address, malloc_items[index].bytes, index + 1);
     malloc_items[index].free = 0;
 
     /* if ((i % 100) == 0) { //Occasionally free some items */
@@ -64,7 +74,7 @@ void *allocate(void *arg) {
 
 int main(int argc, char *argv[])
 {
-  int i, j;
+  int i;
 
   srand(0);
 
@@ -86,37 +96,80 @@ int main(int argc, char *argv[])
     pthread_join(threads[i], NULL);
   } //for i
 
-  //Check for correctness!
+  //Check for correctness! Nothing is freed before this, so the fill
+  //patterns are checked along with the overlaps
+
+  //Requests too large to round up fail instead of wrapping around
+  int oversized = 0;
+  size_t huge_sizes[] = {SIZE_MAX, SIZE_MAX - 8, SIZE_MAX / 2 + 1};
+  for (i=0; i < 3; i++) {
+    errno = 0;
+    if (MALLOC(huge_sizes[i]) != NULL || errno != ENOMEM) {
+      oversized++;
+    } //if
+    //A failed realloc leaves the block allocated
+    int *block = MALLOC(64);
+    errno = 0;
+    if (REALLOC(block, huge_sizes[i]) != NULL || errno != ENOMEM) {
+      oversized++;
+    } //if
+    errno = 0;
+    if (REALLOC(NULL, huge_sizes[i]) != NULL || errno != ENOMEM) {
+      oversized++;
+    } //if
+    FREE(block);
+  } //for i
 
-  int *start, *end, *tgt_start, *tgt_end;
-  int fail = 0;
-  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
-    if (malloc_items[i].free == 1) continue;
-    start = malloc_items[i].address;
-    end   = start + (malloc_items[i].bytes / sizeof(int));
-
-    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
-      if (malloc_items[j].free == 1) continue;
-      if (i == j) continue;
-      tgt_start = malloc_items[j].address;
-      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
-	fail = 1;
-	break;
+  //Cache line aligned blocks keep their last line to themselves: no block
+  //allocated next to them may start or end inside it
+  int shared_lines = 0;
+  char *aligned[NUM_ALIGNED], *others[NUM_ALIGNED];
+  for (i=0; i < NUM_ALIGNED; i++) {
+    aligned[i] = ALIGNED_ALLOC(CACHE_LINE, 16 * (i + 1));
+    others[i] = MALLOC(16 * (i % 8) + 272);
+  } //for i
+  for (i=0; i < NUM_ALIGNED; i++) {
+    uintptr_t line = ((uintptr_t)aligned[i] + 16 * (i + 1) - 1) & ~(uintptr_t)(CACHE_LINE - 1);
+    int j;
+    for (j=0; j < NUM_ALIGNED; j++) {
+      uintptr_t start = (uintptr_t)others[j];
+      uintptr_t end = start + 16 * (j % 8) + 272;
+      if (start < line + CACHE_LINE && end > line) {
+	shared_lines++;
+      } //if
+      start = (uintptr_t)aligned[j];
+      end = start + 16 * (j + 1);
+      if (j != i && start < line + CACHE_LINE && end > line) {
+	shared_lines++;
       } //if
-    }
+    } //for j
+  } //for i
+  for (i=0; i < NUM_ALIGNED; i++) {
+    FREE(aligned[i]);
+    FREE(others[i]);
+  } //for i
 
-    if (fail == 1) break;
+  verify_region_t *regions = malloc(NUM_THREADS * NUM_ITEMS * sizeof(verify_region_t));
+  size_t num_regions = 0;
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 1) continue;
+    regions[num_regions++] = (verify_region_t){(char *)malloc_items[i].address, malloc_items[i].bytes, i, i + 1};
   } //for i
+  int fail = !verify_regions(regions, num_regions, NUM_THREADS);
+  free(regions);
+  if (shared_lines > 0) {
+    printf("%d blocks share the last cache line of an aligned block.\n", shared_lines);
+    fail = 1;
+  } //if
+  if (oversized > 0) {
+    printf("%d oversized requests did not fail with ENOMEM.\n", oversized);
+    fail = 1;
+  } //if
 
   if (fail == 0) {
     printf("No overlapping allocated regions found!\n");
     printf("Test passed\n");
   } else {
-    printf("Found 2 overlapping allocated regions.\n");
-    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
-    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
     printf("Test failed\n");
   } //else
 
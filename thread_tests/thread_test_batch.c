@@ -0,0 +1,170 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "my_malloc.h"
+#include "verify.h"
+
+#ifdef LOCK_VERSION
+#define MALLOC_BATCH(sz, n, out) ts_malloc_batch_lock(sz, n, out)
+#define FREE_BATCH(p, n)         ts_free_batch_lock(p, n)
+#define FREE(p)                  ts_free_lock(p)
+#endif
+#ifdef NOLOCK_VERSION
+#define MALLOC_BATCH(sz, n, out) ts_malloc_batch_nolock(sz, n, out)
+#define FREE_BATCH(p, n)         ts_free_batch_nolock(p, n)
+#define FREE(p)                  ts_free_nolock(p)
+#endif
+
+#define NUM_THREADS  4
+#define NUM_BATCHES  400
+#define BATCH_ITEMS  64
+#define NUM_ITEMS    (NUM_BATCHES * BATCH_ITEMS)
+
+pthread_t threads[NUM_THREADS];
+int       thread_id[NUM_THREADS];
+
+pthread_barrier_t barrier;
+
+struct malloc_list {
+  size_t bytes;
+  int *address;
+  int free;
+};
+typedef struct malloc_list malloc_list_t;
+
+malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int fill_errors = 0; //Blocks found overwritten when they were freed
+int short_batches = 0; //Batches that came back with fewer blocks
+
+
+//Free the blocks of one batch, checking their patterns first
+void free_batch(int first) {
+  void *ptrs[BATCH_ITEMS];
+  int i;
+
+  for (i=0; i < BATCH_ITEMS; i++) {
+    if (!verify_check_fill(malloc_items[first + i].address, malloc_items[first + i].bytes, first + i + 1)) {
+      __atomic_fetch_add(&fill_errors, 1, __ATOMIC_RELAXED);
+    } //if
+    ptrs[i] = malloc_items[first + i].address;
+    malloc_items[first + i].free = 1;
+  } //for i
+  FREE_BATCH(ptrs, BATCH_ITEMS);
+}
+
+
+void do_allocate(int thread_id) {
+  int i, j, index;
+  int thread_start_index = thread_id * NUM_ITEMS;
+  void *out[BATCH_ITEMS];
+
+  //Let all threads get up and running
+  pthread_barrier_wait(&barrier);
+
+  for (i=0; i < NUM_BATCHES; i++) {
+    index = thread_start_index + i * BATCH_ITEMS;
+    size_t bytes = malloc_items[index].bytes;
+    if (MALLOC_BATCH(bytes, BATCH_ITEMS, out) != BATCH_ITEMS) {
+      __atomic_fetch_add(&short_batches, 1, __ATOMIC_RELAXED);
+    } //if
+    for (j=0; j < BATCH_ITEMS; j++) {
+      malloc_items[index + j].address = out[j];
+      verify_fill(out[j], bytes, index + j + 1);
+      malloc_items[index + j].free = 0;
+    } //for j
+
+    if ((i % 4) == 3) { //Free an earlier batch at once
+      free_batch(index - 2 * BATCH_ITEMS);
+    } //if
+    if ((i % 4) == 1) { //and every other block of another one by one
+      for (j=0; j < BATCH_ITEMS; j += 2) {
+	FREE(malloc_items[index - BATCH_ITEMS + j].address);
+	malloc_items[index - BATCH_ITEMS + j].free = 1;
+      } //for j
+    } //if
+  } //for i
+
+  pthread_barrier_wait(&barrier);
+}
+
+
+void *allocate(void *arg) {
+  int id = *((int *) arg);
+  do_allocate(id);
+  return NULL;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int i, j;
+
+  srand(0);
+
+  //One size per batch, from slab objects to carved nodes and mappings
+  for (i=0; i < NUM_THREADS * NUM_BATCHES; i++) {
+    size_t bytes = (rand() % 128 + 1) * 16;
+    if (rand() % 50 == 0) {
+      bytes = 160 * 1024;
+    } //if
+    for (j=0; j < BATCH_ITEMS; j++) {
+      malloc_items[i * BATCH_ITEMS + j].bytes = bytes;
+    } //for j
+  } //for i
+
+  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  for (i=0; i < NUM_THREADS; i++) {
+    thread_id[i] = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  } //for i
+
+  for (i=0; i < NUM_THREADS; i++) {
+    pthread_join(threads[i], NULL);
+  } //for i
+
+  //Check for correctness!
+
+  //A batch too large to round up fails as a whole
+  void *huge[2];
+  errno = 0;
+  int oversized = (MALLOC_BATCH(SIZE_MAX, 2, huge) != 0 || huge[0] != NULL || huge[1] != NULL || errno != ENOMEM);
+
+  verify_region_t *regions = malloc(NUM_THREADS * NUM_ITEMS * sizeof(verify_region_t));
+  void **ptrs = malloc(NUM_THREADS * NUM_ITEMS * sizeof(void *));
+  size_t num_regions = 0;
+  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
+    if (malloc_items[i].free == 1) continue;
+    ptrs[num_regions] = malloc_items[i].address;
+    regions[num_regions++] = (verify_region_t){(char *)malloc_items[i].address, malloc_items[i].bytes, i, i + 1};
+  } //for i
+  int fail = !verify_regions(regions, num_regions, NUM_THREADS);
+  free(regions);
+  if (fill_errors > 0) {
+    printf("Found %d freed regions that had been overwritten.\n", fill_errors);
+    fail = 1;
+  } //if
+  if (short_batches > 0) {
+    printf("%d batches were not allocated in full.\n", short_batches);
+    fail = 1;
+  } //if
+  if (oversized) {
+    printf("An oversized batch did not fail with ENOMEM.\n");
+    fail = 1;
+  } //if
+
+  if (fail == 0) {
+    printf("No overlapping allocated regions found!\n");
+    printf("Test passed\n");
+  } else {
+    printf("Test failed\n");
+  } //else
+
+  //The blocks of all threads go back in one batch
+  FREE_BATCH(ptrs, num_regions);
+  free(ptrs);
+
+  return 0;
+}
@@ -0,0 +1,292 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
+#include "my_malloc.h"
+#include "bench_common.h"
+
+// Times every malloc and free of a steady churn: each thread keeps a
+// window of slots and on every operation frees the block in a random slot
+// or fills it when it is empty. Latencies go into per-thread histograms per
+// operation and request size class, merged and reported as percentiles.
+
+#define NUM_THREADS  4
+#define NUM_OPS      200000
+#define WINDOW       1000
+#define MAX_THREADS  256
+
+enum { OP_MALLOC, OP_FREE, OP_COUNT };
+static const char *op_names[] = {"malloc", "free"};
+
+// Upper bounds of the request size classes
+#define SIZE_CLASSES 8
+static const size_t class_limits[SIZE_CLASSES] = {64, 256, 1024, 4096, 16384, 65536, 262144, (size_t)-1};
+static const char *class_names[SIZE_CLASSES] = {"<=64", "<=256", "<=1K", "<=4K", "<=16K", "<=64K", "<=256K", ">256K"};
+
+enum { TIMER_TSC, TIMER_CLOCK };
+
+struct config {
+  int num_threads;
+  int num_ops;
+  int window;
+  size_dist_t dist;
+  int timer;
+  int format;
+};
+
+struct thread_data {
+  pthread_t thread;
+  int id;
+  histogram_t hist[OP_COUNT][SIZE_CLASSES];
+};
+
+static struct config cfg;
+static const allocator_t *alloc;
+static struct thread_data *thread_data;
+static double ns_per_tick = 1.0;
+pthread_barrier_t barrier;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -t, --threads N     threads (default %d)\n"
+	  "  -n, --ops N         timed operations per thread (default %d)\n"
+	  "  -w, --window N      live blocks per thread (default %d)\n"
+	  "  -d, --dist SPEC     size distribution as for thread_test_measurement\n"
+	  "                      (default lognormal:256:1.5)\n"
+	  "  -T, --timer T       tsc or clock (default tsc where available)\n"
+	  "  -A, --alloc LIST    comma separated lock,lock-mutex,lock-cpu,nolock,glibc (default lock,nolock)\n"
+	  "  -o, --format F      text, json or csv (default text)\n",
+	  prog, NUM_THREADS, NUM_OPS, WINDOW);
+  exit(EXIT_FAILURE);
+}
+
+
+static inline unsigned long timer_start(void) {
+#ifdef __x86_64__
+  if (cfg.timer == TIMER_TSC) {
+    _mm_lfence();
+    return __rdtsc();
+  }
+#endif
+  return (unsigned long)now_ns();
+}
+
+static inline unsigned long timer_end(void) {
+#ifdef __x86_64__
+  if (cfg.timer == TIMER_TSC) {
+    unsigned int aux;
+    unsigned long tsc = __rdtscp(&aux);
+    _mm_lfence();
+    return tsc;
+  }
+#endif
+  return (unsigned long)now_ns();
+}
+
+// Ticks of the time stamp counter per nanosecond, against CLOCK_MONOTONIC
+static void calibrate_timer(void) {
+  if (cfg.timer != TIMER_TSC) {
+    return;
+  }
+  struct timespec pause = {0, 50 * 1000 * 1000};
+  double start_ns = now_ns();
+  unsigned long start = timer_start();
+  nanosleep(&pause, NULL);
+  unsigned long end = timer_end();
+  double end_ns = now_ns();
+  ns_per_tick = (end_ns - start_ns) / (double)(end - start);
+}
+
+static int size_class(size_t size) {
+  int c = 0;
+  while (size > class_limits[c]) c++;
+  return c;
+}
+
+
+static void *churn(void *arg) {
+  struct thread_data *data = arg;
+  void **blocks = calloc(cfg.window, sizeof(void *));
+  size_t *sizes = calloc(cfg.window, sizeof(size_t));
+  unsigned seed = data->id + 1;
+  unsigned long start, end;
+
+  pthread_barrier_wait(&barrier);
+  for (int i=0; i < cfg.num_ops; i++) {
+    int slot = rand_r(&seed) % cfg.window;
+    if (blocks[slot] != NULL) {
+      start = timer_start();
+      alloc->free_fn(blocks[slot]);
+      end = timer_end();
+      hist_record(&data->hist[OP_FREE][size_class(sizes[slot])], end - start);
+      blocks[slot] = NULL;
+    } else {
+      size_t size = sizes[slot] = next_size_r(&cfg.dist, &seed);
+      start = timer_start();
+      blocks[slot] = alloc->malloc_fn(size);
+      end = timer_end();
+      hist_record(&data->hist[OP_MALLOC][size_class(size)], end - start);
+      // Touch the block the way a caller would
+      *(char *)blocks[slot] = 1;
+    } //else
+  } //for i
+  pthread_barrier_wait(&barrier);
+
+  for (int i=0; i < cfg.window; i++) {
+    alloc->free_fn(blocks[i]);
+  } //for i
+  free(blocks);
+  free(sizes);
+  return NULL;
+}
+
+
+static void print_row(const char *op, const char *cls, const histogram_t *hist) {
+  double mean = hist->sum / hist->total * ns_per_tick;
+  double p50 = hist_percentile(hist, 0.50) * ns_per_tick;
+  double p99 = hist_percentile(hist, 0.99) * ns_per_tick;
+  double p999 = hist_percentile(hist, 0.999) * ns_per_tick;
+  double max = hist->max * ns_per_tick;
+
+  if (cfg.format == FORMAT_TEXT) {
+    printf("%-10s %-7s %-7s %10lu %10.0f %10.0f %10.0f %10.0f %12.0f\n",
+	   alloc->name, op, cls, hist->total, mean, p50, p99, p999, max);
+  } else if (cfg.format == FORMAT_JSON) {
+    printf("{\"allocator\": \"%s\", \"op\": \"%s\", \"size_class\": \"%s\", \"count\": %lu, "
+	   "\"mean_ns\": %.1f, \"p50_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, \"max_ns\": %.1f}\n",
+	   alloc->name, op, cls, hist->total, mean, p50, p99, p999, max);
+  } else {
+    printf("%s,%s,%s,%lu,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+	   alloc->name, op, cls, hist->total, mean, p50, p99, p999, max);
+  } //else
+}
+
+static void run_allocator(void) {
+  int i, op, c;
+  histogram_t *total = calloc(1, sizeof(histogram_t));
+
+  memset(thread_data, 0, cfg.num_threads * sizeof(struct thread_data));
+  pthread_barrier_init(&barrier, NULL, cfg.num_threads);
+  for (i=0; i < cfg.num_threads; i++) {
+    thread_data[i].id = i;
+    pthread_create(&thread_data[i].thread, NULL, churn, &thread_data[i]);
+  } //for i
+  for (i=0; i < cfg.num_threads; i++) {
+    pthread_join(thread_data[i].thread, NULL);
+  } //for i
+  pthread_barrier_destroy(&barrier);
+
+  for (op=0; op < OP_COUNT; op++) {
+    memset(total, 0, sizeof(histogram_t));
+    for (c=0; c < SIZE_CLASSES; c++) {
+      histogram_t cls;
+      memset(&cls, 0, sizeof(cls));
+      for (i=0; i < cfg.num_threads; i++) {
+	hist_merge(&cls, &thread_data[i].hist[op][c]);
+      } //for i
+      if (cls.total > 0) {
+	print_row(op_names[op], class_names[c], &cls);
+	hist_merge(total, &cls);
+      } //if
+    } //for c
+    if (total->total > 0) {
+      print_row(op_names[op], "all", total);
+    } //if
+  } //for op
+  free(total);
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"ops", required_argument, NULL, 'n'},
+    {"window", required_argument, NULL, 'w'},
+    {"dist", required_argument, NULL, 'd'},
+    {"timer", required_argument, NULL, 'T'},
+    {"alloc", required_argument, NULL, 'A'},
+    {"format", required_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0}
+  };
+  char alloc_list[256] = "lock,nolock";
+  int opt;
+
+  cfg.num_threads = NUM_THREADS;
+  cfg.num_ops = NUM_OPS;
+  cfg.window = WINDOW;
+  parse_size_dist("lognormal:256:1.5", &cfg.dist);
+#ifdef __x86_64__
+  cfg.timer = TIMER_TSC;
+#else
+  cfg.timer = TIMER_CLOCK;
+#endif
+  cfg.format = FORMAT_TEXT;
+
+  while ((opt = getopt_long(argc, argv, "t:n:w:d:T:A:o:", options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      cfg.num_threads = atoi(optarg);
+      if (cfg.num_threads < 1 || cfg.num_threads > MAX_THREADS) usage(argv[0]);
+      break;
+    case 'n':
+      cfg.num_ops = atoi(optarg);
+      if (cfg.num_ops < 1) usage(argv[0]);
+      break;
+    case 'w':
+      cfg.window = atoi(optarg);
+      if (cfg.window < 1) usage(argv[0]);
+      break;
+    case 'd':
+      if (!parse_size_dist(optarg, &cfg.dist)) usage(argv[0]);
+      break;
+    case 'T':
+      if (strcmp(optarg, "clock") == 0) cfg.timer = TIMER_CLOCK;
+#ifdef __x86_64__
+      else if (strcmp(optarg, "tsc") == 0) cfg.timer = TIMER_TSC;
+#endif
+      else usage(argv[0]);
+      break;
+    case 'A':
+      snprintf(alloc_list, sizeof(alloc_list), "%s", optarg);
+      break;
+    case 'o':
+      cfg.format = parse_format(optarg);
+      if (cfg.format < 0) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    } //switch
+  } //while
+
+  calibrate_timer();
+  thread_data = calloc(cfg.num_threads, sizeof(struct thread_data));
+  if (thread_data == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  } //if
+
+  if (cfg.format == FORMAT_TEXT) {
+    printf("%-10s %-7s %-7s %10s %10s %10s %10s %10s %12s\n",
+	   "alloc", "op", "size", "count", "mean ns", "p50 ns", "p99 ns", "p99.9 ns", "max ns");
+  } else if (cfg.format == FORMAT_CSV) {
+    printf("allocator,op,size_class,count,mean_ns,p50_ns,p99_ns,p999_ns,max_ns\n");
+  } //else
+
+  char *saveptr;
+  for (char *name = strtok_r(alloc_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    alloc = find_allocator(name);
+    if (alloc == NULL) usage(argv[0]);
+    run_allocator();
+  } //for name
+
+  free(thread_data);
+  return 0;
+}
@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include "my_malloc.h"
+#include "verify.h"
 
 #ifdef LOCK_VERSION
 #define MALLOC(sz) ts_malloc_lock(sz)
@@ -29,6 +30,7 @@ struct malloc_list {
 typedef struct malloc_list malloc_list_t;
 
 malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+int fill_errors = 0; //Blocks found overwritten when they were freed
 
 
 void do_allocate(int thread_id) {
@@ -43,9 +45,13 @@ void do_allocate(int thread_id) {
   for (i=0; i < NUM_ITEMS; i++) {
     index = i + thread_start_index;
     malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
+    verify_fill(malloc_items[index].address, malloc_items[index].bytes, index + 1);
     malloc_items[index].free = 0;
 
     if ((i % 10) == 0) { //Occasionally free some items
+      if (!verify_check_fill(malloc_items[counter].address, malloc_items[counter].bytes, counter + 1)) {
+	__atomic_fetch_add(&fill_errors, 1, __ATOMIC_RELAXED);
+      } //if
       FREE(malloc_items[counter].address);
       malloc_items[counter].free = 1;
       counter++;
@@ -65,7 +71,7 @@ void *allocate(void *arg) {
 
 int main(int argc, char *argv[])
 {
-  int i, j;
+  int i;
 
   srand(0);
 
@@ -89,35 +95,23 @@ int main(int argc, char *argv[])
 
   //Check for correctness!
 
-  int *start, *end, *tgt_start, *tgt_end;
-  int fail = 0;
+  verify_region_t *regions = malloc(NUM_THREADS * NUM_ITEMS * sizeof(verify_region_t));
+  size_t num_regions = 0;
   for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
     if (malloc_items[i].free == 1) continue;
-    start = malloc_items[i].address;
-    end   = start + (malloc_items[i].bytes / sizeof(int));
-
-    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
-      if (malloc_items[j].free == 1) continue;
-      if (i == j) continue;
-      tgt_start = malloc_items[j].address;
-      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
-	fail = 1;
-	break;
-      } //if
-    }
-
-    if (fail == 1) break;
+    regions[num_regions++] = (verify_region_t){(char *)malloc_items[i].address, malloc_items[i].bytes, i, i + 1};
   } //for i
+  int fail = !verify_regions(regions, num_regions, NUM_THREADS);
+  free(regions);
+  if (fill_errors > 0) {
+    printf("Found %d freed regions that had been overwritten.\n", fill_errors);
+    fail = 1;
+  } //if
 
   if (fail == 0) {
     printf("No overlapping allocated regions found!\n");
     printf("Test passed\n");
   } else {
-    printf("Found 2 overlapping allocated regions.\n");
-    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
-    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
     printf("Test failed\n");
   } //else
 
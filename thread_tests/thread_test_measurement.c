@@ -1,39 +1,65 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <math.h>
 #include <time.h>
+#include <getopt.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/wait.h>
 #include "my_malloc.h"
+#include "bench_common.h"
+#include "verify.h"
 
-#ifdef LOCK_VERSION
-#define MALLOC(sz) ts_malloc_lock(sz)
-#define FREE(p)    ts_free_lock(p)
-#endif
-#ifdef NOLOCK_VERSION
-#define MALLOC(sz) ts_malloc_nolock(sz)
-#define FREE(p)    ts_free_nolock(p)
-#endif
-
+// Without options this runs the original measurement: 4 threads allocating
+// 20000 items each of 128 to 1024 bytes, even threads freeing another
+// thread's items on every 4th allocation, against the version the test was
+// built for (MALLOC_VERSION in the Makefile). Each run forks, so that every
+// run starts with an empty allocator and its peak RSS is its own.
 #define NUM_THREADS  4
 #define NUM_ITEMS    20000
+#define MAX_THREADS  256
 
-double calc_time(struct timespec start, struct timespec end) {
-  double start_sec = (double)start.tv_sec*1000000000.0 + (double)start.tv_nsec;
-  double end_sec = (double)end.tv_sec*1000000000.0 + (double)end.tv_nsec;
-
-  if (end_sec < start_sec) {
-    return 0;
-  } else {
-    return end_sec - start_sec;
-  }
-};
-
+// Which items a freeing thread frees
+enum { PATTERN_ROTATE, PATTERN_LOCAL, PATTERN_RANDOM };
+static const char *pattern_names[] = {"rotate", "local", "random"};
 
-pthread_t threads[NUM_THREADS];
-int       thread_id[NUM_THREADS];
+static void usage(const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -t, --threads N        threads (default %d)\n"
+	  "  -n, --ops N            allocations per thread (default %d)\n"
+	  "  -d, --dist SPEC        uniform:<min>:<max>, lognormal:<median>:<sigma>\n"
+	  "                         or bimodal:<small>:<large>:<p> (default uniform:128:1024)\n"
+	  "  -f, --free-ratio R     frees per allocation of a freeing thread (default 0.25)\n"
+	  "  -p, --pattern P        rotate: free the next thread's items,\n"
+	  "                         local: free own items, random: free any item (default rotate)\n"
+	  "  -a, --all-free         every thread frees, not only the even ones\n"
+	  "  -A, --alloc LIST       comma separated lock,lock-mutex,lock-cpu,nolock,glibc (default %s)\n"
+	  "  -r, --repeat N         runs per allocator (default 1)\n"
+	  "  -o, --format F         text, json or csv (default text)\n"
+	  "  -s, --no-verify        skip the overlap check\n"
+	  "  -F, --fill             fill every block with a pattern and check it when it is\n"
+	  "                         freed and after the run (inside the timed region)\n"
+	  "  -e, --perf             count cycles, instructions, cache, dTLB misses and context\n"
+	  "                         switches per phase and thread, where perf_event_open() allows\n",
+	  prog, NUM_THREADS, NUM_ITEMS, DEFAULT_ALLOCATOR);
+  exit(EXIT_FAILURE);
+}
 
-pthread_barrier_t barrier;
-pthread_mutex_t   my_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct config {
+  int num_threads;
+  int num_items;
+  size_dist_t dist;
+  double free_ratio;
+  int pattern;
+  int all_free;
+  int repeat;
+  int format;
+  int verify;
+  int fill;
+  int perf;
+};
 
 struct malloc_list {
   size_t bytes;
@@ -42,130 +68,426 @@ struct malloc_list {
 };
 typedef struct malloc_list malloc_list_t;
 
-malloc_list_t malloc_items[NUM_THREADS * NUM_ITEMS];
+struct thread_arg {
+  int id;
+  unsigned long ops;
+  perf_values_t perf;
+};
+
+static struct config cfg;
+static const allocator_t *alloc;
+static malloc_list_t *malloc_items;
+static pthread_t threads[MAX_THREADS];
+static struct thread_arg thread_args[MAX_THREADS];
+static int perf_header_done = 0; // Set in the parent once a run printed it
+static int fill_errors = 0; // Blocks found overwritten when they were freed
+
+pthread_barrier_t barrier;
+pthread_mutex_t   my_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// True when a free falls on allocation i, spreading free_ratio frees evenly
+// over the allocations. A ratio of 0.25 frees on every 4th one from i = 0.
+static int free_due(int i) {
+  return ceil(i * cfg.free_ratio) < ceil((i + 1) * cfg.free_ratio);
+}
+
+
+// Claim an allocated item for this thread to free, -1 if there is none
+static int claim_item(int index) {
+  int claimed = -1;
+  pthread_mutex_lock(&my_mutex);
+  if (__atomic_load_n(&malloc_items[index].free, __ATOMIC_ACQUIRE) == 0) {
+    malloc_items[index].free = 1;
+    claimed = index;
+  } //if
+  pthread_mutex_unlock(&my_mutex);
+  return claimed;
+}
 
 
-void do_allocate(int thread_id) {
-  int i, index;
-  int do_free;
+void do_allocate(struct thread_arg *arg) {
+  int i, index, victim;
+  int thread_id = arg->id;
+  int total_items = cfg.num_threads * cfg.num_items;
+  unsigned seed = thread_id + 1;
+  unsigned long ops = 0;
   //Rotate the counter so that each thread will free addresses
   //that were malloc'ed by another thread.
-  int counter = ((thread_id+1)%NUM_THREADS) * NUM_ITEMS;
-  int thread_start_index = thread_id * NUM_ITEMS;
+  int counter = ((thread_id+1)%cfg.num_threads) * cfg.num_items;
+  int thread_start_index = thread_id * cfg.num_items;
+  if (cfg.pattern == PATTERN_LOCAL) {
+    counter = thread_start_index;
+  } //if
+  int freeing = cfg.all_free || (thread_id % 2) == 0;
+  perf_counters_t counters;
+  perf_values_t perf_start, perf_end;
+  if (cfg.perf) {
+    perf_open(&counters);
+  } //if
 
   //Let all threads get up and running
   //Want the concurrent malloc calls to be as high as possible
-  pthread_barrier_wait(&barrier); 
+  pthread_barrier_wait(&barrier);
+  if (cfg.perf) {
+    perf_read(&counters, &perf_start);
+  } //if
 
-  for (i=0; i < NUM_ITEMS; i++) {
+  for (i=0; i < cfg.num_items; i++) {
     index = i + thread_start_index;
-    malloc_items[index].address = (int *)MALLOC(malloc_items[index].bytes);
-    malloc_items[index].free = 0;
-
-    if ((thread_id % 2) == 0) {
-      if ((i % 4) == 0) { //Occasionally free some items
-	pthread_mutex_lock(&my_mutex);
-	if (malloc_items[counter].free == 0) {
-	  malloc_items[counter].free = 1;
-	  do_free = 1;
-	} else {
-	  do_free = 0;
-	} //else
-	pthread_mutex_unlock(&my_mutex);
-	if (do_free == 1) {
-	  FREE(malloc_items[counter].address);
+    malloc_items[index].address = (int *)alloc->malloc_fn(malloc_items[index].bytes);
+    if (cfg.fill) {
+      verify_fill(malloc_items[index].address, malloc_items[index].bytes, index + 1);
+    } //if
+    __atomic_store_n(&malloc_items[index].free, 0, __ATOMIC_RELEASE);
+    ops++;
+
+    if (freeing && free_due(i)) { //Occasionally free some items
+      if (cfg.pattern == PATTERN_RANDOM) {
+	victim = claim_item(rand_r(&seed) % total_items);
+      } else {
+	victim = (counter < total_items) ? claim_item(counter) : -1;
+	if (victim >= 0) {
 	  counter++;
 	} //if
+      } //else
+      if (victim >= 0) {
+	if (cfg.fill && !verify_check_fill(malloc_items[victim].address, malloc_items[victim].bytes, victim + 1)) {
+	  __atomic_fetch_add(&fill_errors, 1, __ATOMIC_RELAXED);
+	} //if
+	alloc->free_fn(malloc_items[victim].address);
+	ops++;
       } //if
-    }
+    } //if
   } //for i
 
+  if (cfg.perf) {
+    perf_read(&counters, &perf_end);
+    perf_diff(&perf_start, &perf_end, &arg->perf);
+    perf_close(&counters);
+  } //if
+  arg->ops = ops;
   pthread_barrier_wait(&barrier);
 }
 
 
 void *allocate(void *arg) {
-  int id = *((int *) arg);
-  do_allocate(id);
+  do_allocate((struct thread_arg *)arg);
   return NULL;
-} 
+}
 
 
-int main(int argc, char *argv[])
-{
-  int i, j;
+// Returns 1 if no two allocated items overlap and, with --fill, no block
+// was overwritten
+static int check_regions(void) {
+  int i;
+  int total_items = cfg.num_threads * cfg.num_items;
+  size_t count = 0;
+  verify_region_t *regions = malloc(total_items * sizeof(verify_region_t));
+  if (regions == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  } //if
+
+  for (i=0; i < total_items; i++) {
+    if (malloc_items[i].free == 1) continue;
+    regions[count++] = (verify_region_t){(char *)malloc_items[i].address, malloc_items[i].bytes, i,
+					 cfg.fill ? (unsigned long)i + 1 : 0};
+  } //for i
+  int passed = verify_regions(regions, count, cfg.num_threads);
+  free(regions);
+  if (fill_errors > 0) {
+    printf("Found %d freed regions that had been overwritten.\n", fill_errors);
+    passed = 0;
+  } //if
+  return passed;
+}
+
+
+struct result {
+  double elapsed_ns;
+  unsigned long ops;
+  unsigned long free_ops; // Blocks left at the end and freed by the main thread
+  perf_values_t free_perf;
+  unsigned long data_segment;
+  long rss;
+  long max_rss;
+  int passed;
+};
+
+static void run_once(struct result *res) {
+  int i;
+  int total_items = cfg.num_threads * cfg.num_items;
   struct timespec start_time, end_time;
   void *start_segment_addr, *end_segment_addr;
 
   srand(0);
-
-  const unsigned chunk_size = 32;
-  const unsigned min_chunks = 4;
-  const unsigned max_chunks = 32;
-  //const unsigned max_chunks = 16384;
-  for (i=0; i < NUM_THREADS*NUM_ITEMS; i++) {
-    unsigned num_chunks = (rand() % (max_chunks - min_chunks + 1)) + min_chunks;
-    malloc_items[i].bytes = num_chunks * chunk_size;
+  fill_errors = 0;
+  for (i=0; i < total_items; i++) {
+    malloc_items[i].bytes = next_size(&cfg.dist);
     malloc_items[i].free = 1;
   } //for i
 
-  pthread_barrier_init(&barrier, NULL, NUM_THREADS);
+  pthread_barrier_init(&barrier, NULL, cfg.num_threads);
 
   start_segment_addr = sbrk(0);
   clock_gettime(CLOCK_MONOTONIC, &start_time);
-  for (i=0; i < NUM_THREADS; i++) {
-    thread_id[i] = i;
-    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_id[i]));
+  for (i=0; i < cfg.num_threads; i++) {
+    thread_args[i].id = i;
+    pthread_create(&threads[i], NULL, allocate, (void *)(&thread_args[i]));
   } //for i
-  for (i=0; i < NUM_THREADS; i++) {
+  for (i=0; i < cfg.num_threads; i++) {
     pthread_join(threads[i], NULL);
   } //for i
   clock_gettime(CLOCK_MONOTONIC, &end_time);
   end_segment_addr = sbrk(0);
+  pthread_barrier_destroy(&barrier);
 
-  //Check for correctness!
+  res->rss = current_rss();
+  res->max_rss = peak_rss();
+  // The kernel updates the high-water mark lazily
+  if (res->rss > res->max_rss) res->max_rss = res->rss;
+  res->passed = cfg.verify ? check_regions() : 1;
 
-  int *start, *end, *tgt_start, *tgt_end;
-  int fail = 0;
-  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
-    if (malloc_items[i].free == 1) continue;
-    start = malloc_items[i].address;
-    end   = start + (malloc_items[i].bytes / sizeof(int));
-
-    for (j=0; j < NUM_THREADS * NUM_ITEMS; j++) {
-      if (malloc_items[j].free == 1) continue;
-      if (i == j) continue;
-      tgt_start = malloc_items[j].address;
-      tgt_end   = tgt_start + (malloc_items[j].bytes / sizeof(int));
-      if (((start >= tgt_start) && (start <= tgt_end)) ||
-	  ((end >= tgt_start) && (end <= tgt_end))) {
-	fail = 1;
-	break;
-      } //if
-    }
+  perf_counters_t counters;
+  perf_values_t perf_start, perf_end;
+  if (cfg.perf) {
+    perf_open(&counters);
+    perf_read(&counters, &perf_start);
+  } //if
+  res->free_ops = 0;
+  for (i=0; i < total_items; i++) {
+    if (malloc_items[i].free == 0) {
+      alloc->free_fn(malloc_items[i].address);
+      res->free_ops++;
+    } //if
+  } //for i
+  if (cfg.perf) {
+    perf_read(&counters, &perf_end);
+    perf_diff(&perf_start, &perf_end, &res->free_perf);
+    perf_close(&counters);
+  } //if
 
-    if (fail == 1) break;
+  res->elapsed_ns = calc_time(start_time, end_time);
+  res->ops = 0;
+  for (i=0; i < cfg.num_threads; i++) {
+    res->ops += thread_args[i].ops;
   } //for i
+  res->data_segment = (unsigned long)(end_segment_addr - start_segment_addr);
+}
+
+
+// One line of counters per operation, thread -1 for the sum of all threads
+static void print_perf(int run, const char *phase, int thread, unsigned long ops, const perf_values_t *perf) {
+  int i;
+
+  if (cfg.format == FORMAT_TEXT) {
+    if (!perf_header_done) {
+      printf("%-10s %-6s %-6s %10s", "perf", "phase", "thread", "ops");
+      for (i=0; i < PERF_EVENTS; i++) printf(" %16s", perf_event_names[i]);
+      printf("   (per operation)\n");
+    } //if
+    char label[16] = "all";
+    if (thread >= 0) snprintf(label, sizeof(label), "%d", thread);
+    printf("%-10s %-6s %-6s %10lu", alloc->name, phase, label, ops);
+    for (i=0; i < PERF_EVENTS; i++) {
+      if (perf->values[i] < 0 || ops == 0) printf(" %16s", "n/a");
+      else printf(" %16.4f", perf->values[i] / ops);
+    } //for i
+    printf("\n");
+  } else if (cfg.format == FORMAT_JSON) {
+    printf("{\"perf\": true, \"allocator\": \"%s\", \"run\": %d, \"phase\": \"%s\", \"thread\": %d, \"ops\": %lu",
+	   alloc->name, run, phase, thread, ops);
+    for (i=0; i < PERF_EVENTS; i++) {
+      if (perf->values[i] < 0) printf(", \"%s\": null, \"%s_per_op\": null", perf_event_names[i], perf_event_names[i]);
+      else printf(", \"%s\": %.0f, \"%s_per_op\": %.4f", perf_event_names[i], perf->values[i],
+		  perf_event_names[i], (ops > 0) ? perf->values[i] / ops : 0);
+    } //for i
+    printf("}\n");
+  } else {
+    // Counter rows start with "perf" and have their own header
+    if (!perf_header_done) {
+      printf("perf,allocator,run,phase,thread,ops");
+      for (i=0; i < PERF_EVENTS; i++) printf(",%s_per_op", perf_event_names[i]);
+      printf("\n");
+    } //if
+    printf("perf,%s,%d,%s,%d,%lu", alloc->name, run, phase, thread, ops);
+    for (i=0; i < PERF_EVENTS; i++) {
+      if (perf->values[i] < 0 || ops == 0) printf(",");
+      else printf(",%.4f", perf->values[i] / ops);
+    } //for i
+    printf("\n");
+  } //else
+  perf_header_done = 1;
+}
+
+static void print_result(const struct result *res, int run) {
+  char dist[64];
+  double seconds = res->elapsed_ns / 1e9;
+  double throughput = (seconds > 0) ? res->ops / seconds : 0;
+  format_size_dist(&cfg.dist, dist, sizeof(dist));
 
-  if (fail == 0) {
-    printf("No overlapping allocated regions found!\n");
-    printf("Test passed\n");
+  if (cfg.format == FORMAT_TEXT) {
+    if (res->passed) {
+      printf("No overlapping allocated regions found!\n");
+      printf("Test passed\n");
+    } else {
+      printf("Test failed\n");
+    } //else
+    printf("Execution Time = %f seconds\n", seconds);
+    printf("Data Segment Size = %lu bytes\n", res->data_segment);
+  } else if (cfg.format == FORMAT_JSON) {
+    printf("{\"allocator\": \"%s\", \"run\": %d, \"threads\": %d, \"ops_per_thread\": %d, "
+	   "\"dist\": \"%s\", \"free_ratio\": %g, \"pattern\": \"%s\", \"all_free\": %d, "
+	   "\"passed\": %s, \"time_s\": %f, \"ops\": %lu, \"ops_per_s\": %.0f, "
+	   "\"data_segment_bytes\": %lu, \"rss_bytes\": %ld, \"max_rss_bytes\": %ld}\n",
+	   alloc->name, run, cfg.num_threads, cfg.num_items, dist, cfg.free_ratio,
+	   pattern_names[cfg.pattern], cfg.all_free, res->passed ? "true" : "false",
+	   seconds, res->ops, throughput, res->data_segment, res->rss, res->max_rss);
   } else {
-    printf("Found 2 overlapping allocated regions.\n");
-    printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", start, end, malloc_items[i].bytes, i);
-    printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%d\n", tgt_start, tgt_end, malloc_items[j].bytes, j);
-    printf("Test failed\n");
+    printf("%s,%d,%d,%d,%s,%g,%s,%d,%d,%f,%lu,%.0f,%lu,%ld,%ld\n",
+	   alloc->name, run, cfg.num_threads, cfg.num_items, dist, cfg.free_ratio,
+	   pattern_names[cfg.pattern], cfg.all_free, res->passed,
+	   seconds, res->ops, throughput, res->data_segment, res->rss, res->max_rss);
   } //else
+}
 
-  for (i=0; i < NUM_THREADS * NUM_ITEMS; i++) {
-    if (malloc_items[i].free == 0) {
-      FREE(malloc_items[i].address);
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"ops", required_argument, NULL, 'n'},
+    {"dist", required_argument, NULL, 'd'},
+    {"free-ratio", required_argument, NULL, 'f'},
+    {"pattern", required_argument, NULL, 'p'},
+    {"all-free", no_argument, NULL, 'a'},
+    {"alloc", required_argument, NULL, 'A'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"format", required_argument, NULL, 'o'},
+    {"no-verify", no_argument, NULL, 's'},
+    {"fill", no_argument, NULL, 'F'},
+    {"perf", no_argument, NULL, 'e'},
+    {NULL, 0, NULL, 0}
+  };
+  char alloc_list[256] = DEFAULT_ALLOCATOR;
+  int opt, i, failed = 0;
+
+  cfg.num_threads = NUM_THREADS;
+  cfg.num_items = NUM_ITEMS;
+  parse_size_dist("uniform:128:1024", &cfg.dist);
+  cfg.free_ratio = 0.25;
+  cfg.pattern = PATTERN_ROTATE;
+  cfg.repeat = 1;
+  cfg.format = FORMAT_TEXT;
+  cfg.verify = 1;
+
+  while ((opt = getopt_long(argc, argv, "t:n:d:f:p:aA:r:o:sFe", options, NULL)) != -1) {
+    switch (opt) {
+    case 't':
+      cfg.num_threads = atoi(optarg);
+      if (cfg.num_threads < 1 || cfg.num_threads > MAX_THREADS) usage(argv[0]);
+      break;
+    case 'n':
+      cfg.num_items = atoi(optarg);
+      if (cfg.num_items < 1) usage(argv[0]);
+      break;
+    case 'd':
+      if (!parse_size_dist(optarg, &cfg.dist)) usage(argv[0]);
+      break;
+    case 'f':
+      cfg.free_ratio = atof(optarg);
+      if (cfg.free_ratio < 0 || cfg.free_ratio > 1) usage(argv[0]);
+      break;
+    case 'p':
+      for (i=0; i < 3 && strcmp(optarg, pattern_names[i]) != 0; i++);
+      if (i == 3) usage(argv[0]);
+      cfg.pattern = i;
+      break;
+    case 'a':
+      cfg.all_free = 1;
+      break;
+    case 'A':
+      snprintf(alloc_list, sizeof(alloc_list), "%s", optarg);
+      break;
+    case 'r':
+      cfg.repeat = atoi(optarg);
+      if (cfg.repeat < 1) usage(argv[0]);
+      break;
+    case 'o':
+      cfg.format = parse_format(optarg);
+      if (cfg.format < 0) usage(argv[0]);
+      break;
+    case 's':
+      cfg.verify = 0;
+      break;
+    case 'F':
+      cfg.fill = 1;
+      break;
+    case 'e':
+      cfg.perf = 1;
+      break;
+    default:
+      usage(argv[0]);
+    } //switch
+  } //while
+
+  malloc_items = calloc((size_t)cfg.num_threads * cfg.num_items, sizeof(malloc_list_t));
+  if (malloc_items == NULL) {
+    perror("calloc");
+    return EXIT_FAILURE;
+  } //if
+
+  if (cfg.format == FORMAT_CSV) {
+    printf("allocator,run,threads,ops_per_thread,dist,free_ratio,pattern,all_free,"
+	   "passed,time_s,ops,ops_per_s,data_segment_bytes,rss_bytes,max_rss_bytes\n");
+  } //if
+  fflush(stdout);
+  // Warn once here rather than in every run's process
+  if (cfg.perf) {
+    perf_counters_t counters;
+    if (perf_open(&counters) == 0) {
+      fprintf(stderr, "No performance counters available, check perf_event_paranoid\n");
     } //if
-  } //for i
+    perf_close(&counters);
+  } //if
 
-  double elapsed_ns = calc_time(start_time, end_time);
-  printf("Execution Time = %f seconds\n", elapsed_ns / 1e9);
-  printf("Data Segment Size = %lu bytes\n", (unsigned long)(end_segment_addr - start_segment_addr));
+  char *saveptr;
+  for (char *name = strtok_r(alloc_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    alloc = find_allocator(name);
+    if (alloc == NULL) usage(argv[0]);
+    for (i=0; i < cfg.repeat; i++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+	struct result res;
+	run_once(&res);
+	print_result(&res, i);
+	if (cfg.perf) {
+	  perf_values_t total;
+	  unsigned long ops = 0;
+	  memset(&total, 0, sizeof(total));
+	  for (int t=0; t < cfg.num_threads; t++) {
+	    print_perf(i, "run", t, thread_args[t].ops, &thread_args[t].perf);
+	    perf_add(&total, &thread_args[t].perf);
+	    ops += thread_args[t].ops;
+	  } //for t
+	  print_perf(i, "run", -1, ops, &total);
+	  print_perf(i, "free", -1, res.free_ops, &res.free_perf);
+	} //if
+	fflush(stdout);
+	_exit(res.passed ? 0 : EXIT_FAILURE);
+      } //if
+      int status;
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+	fprintf(stderr, "%s run %d failed\n", alloc->name, i);
+	failed = 1;
+      } else {
+	failed |= WEXITSTATUS(status) != 0;
+      } //else
+      perf_header_done = cfg.perf;
+    } //for i
+  } //for name
 
-  return 0;
+  free(malloc_items);
+  return failed ? EXIT_FAILURE : 0;
 }
@@ -0,0 +1,456 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+#include "bench_common.h"
+
+// Runs every workload pattern with 1 to N threads and reports throughput
+// and memory blowup, the growth of the resident set over the peak of the
+// bytes requested and not yet freed. Each run forks, so that every
+// allocator starts empty and the peak RSS is that of the run alone.
+//
+//   local     every thread frees and refills random slots of its own window
+//   prodcons  every thread allocates for the next one and frees what the
+//             previous one allocated, so all frees are remote
+//   larson    like local, but every tenth of the run a thread hands its
+//             window to a new thread and exits
+//   rotate    thread_test_malloc_free_change_thread: allocate, and free the
+//             next thread's oldest block on every 10th allocation
+
+#define NUM_OPS      100000
+#define WINDOW       1000
+#define QUEUE_SIZE   4096
+#define LARSON_EPOCHS 10
+#define MAX_THREADS  256
+
+enum { PATTERN_LOCAL, PATTERN_PRODCONS, PATTERN_LARSON, PATTERN_ROTATE, PATTERN_COUNT };
+static const char *pattern_names[] = {"local", "prodcons", "larson", "rotate"};
+
+struct config {
+  int max_threads;
+  int num_ops;
+  int window;
+  size_dist_t dist;
+  int format;
+};
+
+// Blocks handed from one thread to the next in prodcons
+struct queue {
+  pthread_mutex_t lock;
+  void *blocks[QUEUE_SIZE];
+  size_t sizes[QUEUE_SIZE];
+  int head;
+  int count;
+};
+
+struct lane {
+  pthread_t thread;
+  int id;
+  unsigned seed;
+  int epoch;
+  void **blocks;
+  size_t *sizes;
+  long live; // Bytes allocated minus bytes freed by this lane
+  unsigned long ops;
+} __attribute__((aligned(64)));
+
+static struct config cfg;
+static const allocator_t *alloc;
+static int num_threads;
+static struct lane lanes[MAX_THREADS];
+static struct queue *queues;
+static long peak_live;
+static int lanes_done;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int producers_done;
+pthread_barrier_t barrier;
+
+// rotate keeps all blocks of the run in one table like the original test
+struct malloc_list {
+  size_t bytes;
+  int *address;
+  int free;
+};
+static struct malloc_list *malloc_items;
+pthread_mutex_t my_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options]\n"
+	  "  -N, --max-threads N  sweep 1 to N threads (default online CPUs, at least 4)\n"
+	  "  -n, --ops N          operations per thread (default %d)\n"
+	  "  -w, --window N       live blocks per thread of local and larson (default %d)\n"
+	  "  -d, --dist SPEC      size distribution as for thread_test_measurement\n"
+	  "                       (default uniform:32:512)\n"
+	  "  -P, --patterns LIST  comma separated local,prodcons,larson,rotate (default all)\n"
+	  "  -A, --alloc LIST     comma separated lock,lock-mutex,lock-cpu,nolock,glibc (default lock,nolock)\n"
+	  "  -o, --format F       text, json or csv (default text)\n",
+	  prog, NUM_OPS, WINDOW);
+  exit(EXIT_FAILURE);
+}
+
+
+// The live bytes only grow on an allocation, so summing the lanes' counters
+// after every one catches the peak. Each lane only writes its own counter.
+static void update_peak_live(void) {
+  long live = 0;
+  for (int i = 0; i < num_threads; i++) {
+    live += __atomic_load_n(&lanes[i].live, __ATOMIC_RELAXED);
+  } //for i
+  long peak = __atomic_load_n(&peak_live, __ATOMIC_RELAXED);
+  while (live > peak && !__atomic_compare_exchange_n(&peak_live, &peak, live, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+static void *lane_malloc(struct lane *lane, size_t size) {
+  void *ptr = alloc->malloc_fn(size);
+  *(char *)ptr = 1;
+  __atomic_add_fetch(&lane->live, size, __ATOMIC_RELAXED);
+  lane->ops++;
+  update_peak_live();
+  return ptr;
+}
+
+static void lane_free(struct lane *lane, void *ptr, size_t size) {
+  alloc->free_fn(ptr);
+  __atomic_sub_fetch(&lane->live, size, __ATOMIC_RELAXED);
+  lane->ops++;
+}
+
+static void lane_finished(void) {
+  pthread_mutex_lock(&done_lock);
+  lanes_done++;
+  pthread_cond_signal(&done_cond);
+  pthread_mutex_unlock(&done_lock);
+}
+
+
+static void churn(struct lane *lane, int ops) {
+  for (int i=0; i < ops; i++) {
+    int slot = rand_r(&lane->seed) % cfg.window;
+    if (lane->blocks[slot] != NULL) {
+      lane_free(lane, lane->blocks[slot], lane->sizes[slot]);
+      lane->blocks[slot] = NULL;
+    } else {
+      lane->sizes[slot] = next_size_r(&cfg.dist, &lane->seed);
+      lane->blocks[slot] = lane_malloc(lane, lane->sizes[slot]);
+    } //else
+  } //for i
+}
+
+static void *run_local(void *arg) {
+  struct lane *lane = arg;
+  pthread_barrier_wait(&barrier);
+  churn(lane, cfg.num_ops);
+  lane_finished();
+  return NULL;
+}
+
+static void *run_larson(void *arg) {
+  struct lane *lane = arg;
+  if (lane->epoch == 0) {
+    pthread_barrier_wait(&barrier);
+  } //if
+  churn(lane, cfg.num_ops / LARSON_EPOCHS);
+  if (++lane->epoch < LARSON_EPOCHS) {
+    // The successor frees what this thread allocated
+    pthread_t next;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_create(&next, &attr, run_larson, lane);
+    pthread_attr_destroy(&attr);
+  } else {
+    lane_finished();
+  } //else
+  return NULL;
+}
+
+
+static int queue_push(struct queue *q, void *ptr, size_t size) {
+  int pushed = 0;
+  pthread_mutex_lock(&q->lock);
+  if (q->count < QUEUE_SIZE) {
+    int tail = (q->head + q->count) % QUEUE_SIZE;
+    q->blocks[tail] = ptr;
+    q->sizes[tail] = size;
+    q->count++;
+    pushed = 1;
+  } //if
+  pthread_mutex_unlock(&q->lock);
+  return pushed;
+}
+
+// Free what is in the lane's own queue, up to max blocks
+static int queue_drain(struct lane *lane, int max) {
+  struct queue *q = &queues[lane->id];
+  void *blocks[64];
+  size_t sizes[64];
+  int count = 0;
+  if (max > 64) max = 64;
+  pthread_mutex_lock(&q->lock);
+  while (count < max && q->count > 0) {
+    blocks[count] = q->blocks[q->head];
+    sizes[count++] = q->sizes[q->head];
+    q->head = (q->head + 1) % QUEUE_SIZE;
+    q->count--;
+  } //while
+  pthread_mutex_unlock(&q->lock);
+  for (int i=0; i < count; i++) {
+    lane_free(lane, blocks[i], sizes[i]);
+  } //for i
+  return count;
+}
+
+static void *run_prodcons(void *arg) {
+  struct lane *lane = arg;
+  struct queue *next = &queues[(lane->id + 1) % num_threads];
+  pthread_barrier_wait(&barrier);
+  for (int i=0; i < cfg.num_ops / 2; i++) {
+    size_t size = next_size_r(&cfg.dist, &lane->seed);
+    void *ptr = lane_malloc(lane, size);
+    while (!queue_push(next, ptr, size)) {
+      if (queue_drain(lane, 64) == 0) sched_yield();
+    } //while
+    queue_drain(lane, 2);
+  } //for i
+  // Keep freeing until nobody can push any more, others may still be
+  // waiting for room in this lane's queue
+  __atomic_add_fetch(&producers_done, 1, __ATOMIC_RELEASE);
+  while (queue_drain(lane, 64) > 0 || __atomic_load_n(&producers_done, __ATOMIC_ACQUIRE) < num_threads) {
+    sched_yield();
+  } //while
+  while (queue_drain(lane, 64) > 0);
+  lane_finished();
+  return NULL;
+}
+
+
+static void *run_rotate(void *arg) {
+  struct lane *lane = arg;
+  int i, index, do_free;
+  int thread_id = lane->id;
+  int counter = ((thread_id+1)%num_threads) * cfg.num_ops;
+  int thread_start_index = thread_id * cfg.num_ops;
+
+  pthread_barrier_wait(&barrier);
+  for (i=0; i < cfg.num_ops; i++) {
+    index = i + thread_start_index;
+    malloc_items[index].address = (int *)lane_malloc(lane, malloc_items[index].bytes);
+    __atomic_store_n(&malloc_items[index].free, 0, __ATOMIC_RELEASE);
+
+    if ((i % 10) == 0) { //Occasionally free some items
+      pthread_mutex_lock(&my_mutex);
+      if (__atomic_load_n(&malloc_items[counter].free, __ATOMIC_ACQUIRE) == 0) {
+	malloc_items[counter].free = 1;
+	do_free = 1;
+      } else {
+	do_free = 0;
+      } //else
+      pthread_mutex_unlock(&my_mutex);
+      if (do_free == 1) {
+	lane_free(lane, malloc_items[counter].address, malloc_items[counter].bytes);
+	counter++;
+      } //if
+    } //if
+  } //for i
+  lane_finished();
+  return NULL;
+}
+
+
+struct result {
+  double elapsed_ns;
+  unsigned long ops;
+  long peak_live;
+  long rss_growth;
+  unsigned long data_segment;
+};
+
+static void run_pattern(int pattern, struct result *res) {
+  static void *(*const workers[])(void *) = {run_local, run_prodcons, run_larson, run_rotate};
+  struct timespec start_time, end_time;
+  int i, j;
+  long base_rss = current_rss();
+  void *start_segment_addr = sbrk(0);
+
+  queues = calloc(num_threads, sizeof(struct queue));
+  for (i=0; i < num_threads; i++) {
+    pthread_mutex_init(&queues[i].lock, NULL);
+    lanes[i].id = i;
+    lanes[i].seed = i + 1;
+    lanes[i].blocks = calloc(cfg.window, sizeof(void *));
+    lanes[i].sizes = calloc(cfg.window, sizeof(size_t));
+  } //for i
+  if (pattern == PATTERN_ROTATE) {
+    srand(0);
+    malloc_items = calloc((size_t)num_threads * cfg.num_ops, sizeof(struct malloc_list));
+    for (i=0; i < num_threads * cfg.num_ops; i++) {
+      malloc_items[i].bytes = next_size(&cfg.dist);
+      malloc_items[i].free = 1;
+    } //for i
+  } //if
+
+  // The larson successors are detached, so completion is counted
+  pthread_barrier_init(&barrier, NULL, num_threads + 1);
+  for (i=0; i < num_threads; i++) {
+    pthread_create(&lanes[i].thread, NULL, workers[pattern], &lanes[i]);
+    pthread_detach(lanes[i].thread);
+  } //for i
+  //The workers wait for us, so starting the clock first leaves none of their work out
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  pthread_barrier_wait(&barrier);
+  pthread_mutex_lock(&done_lock);
+  while (lanes_done < num_threads) {
+    pthread_cond_wait(&done_cond, &done_lock);
+  } //while
+  pthread_mutex_unlock(&done_lock);
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+
+  res->elapsed_ns = calc_time(start_time, end_time);
+  res->peak_live = peak_live;
+  res->rss_growth = peak_rss() - base_rss;
+  res->data_segment = (unsigned long)(sbrk(0) - start_segment_addr);
+  res->ops = 0;
+  for (i=0; i < num_threads; i++) {
+    res->ops += lanes[i].ops;
+    for (j=0; j < cfg.window; j++) {
+      alloc->free_fn(lanes[i].blocks[j]);
+    } //for j
+  } //for i
+}
+
+
+static void print_result(int pattern, const struct result *res) {
+  double seconds = res->elapsed_ns / 1e9;
+  double throughput = (seconds > 0) ? res->ops / seconds : 0;
+  // Without live bytes there is no blowup to report
+  char blowup[32];
+
+  if (cfg.format == FORMAT_TEXT) {
+    if (res->peak_live > 0) snprintf(blowup, sizeof(blowup), "%.2f", (double)res->rss_growth / res->peak_live);
+    else snprintf(blowup, sizeof(blowup), "n/a");
+    printf("%-10s %-9s %7d %10.4f %12.0f %14ld %14ld %8s\n", alloc->name, pattern_names[pattern],
+	   num_threads, seconds, throughput, res->peak_live, res->rss_growth, blowup);
+  } else if (cfg.format == FORMAT_JSON) {
+    if (res->peak_live > 0) snprintf(blowup, sizeof(blowup), "%.3f", (double)res->rss_growth / res->peak_live);
+    else snprintf(blowup, sizeof(blowup), "null");
+    printf("{\"allocator\": \"%s\", \"pattern\": \"%s\", \"threads\": %d, \"time_s\": %f, "
+	   "\"ops\": %lu, \"ops_per_s\": %.0f, \"peak_live_bytes\": %ld, \"rss_growth_bytes\": %ld, "
+	   "\"data_segment_bytes\": %lu, \"blowup\": %s}\n",
+	   alloc->name, pattern_names[pattern], num_threads, seconds, res->ops, throughput,
+	   res->peak_live, res->rss_growth, res->data_segment, blowup);
+  } else {
+    if (res->peak_live > 0) snprintf(blowup, sizeof(blowup), "%.3f", (double)res->rss_growth / res->peak_live);
+    else blowup[0] = '\0';
+    printf("%s,%s,%d,%f,%lu,%.0f,%ld,%ld,%lu,%s\n", alloc->name, pattern_names[pattern],
+	   num_threads, seconds, res->ops, throughput, res->peak_live, res->rss_growth,
+	   res->data_segment, blowup);
+  } //else
+  fflush(stdout);
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"max-threads", required_argument, NULL, 'N'},
+    {"ops", required_argument, NULL, 'n'},
+    {"window", required_argument, NULL, 'w'},
+    {"dist", required_argument, NULL, 'd'},
+    {"patterns", required_argument, NULL, 'P'},
+    {"alloc", required_argument, NULL, 'A'},
+    {"format", required_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0}
+  };
+  char alloc_list[256] = "lock,nolock";
+  char pattern_list[256] = "local,prodcons,larson,rotate";
+  int patterns[PATTERN_COUNT];
+  int num_patterns = 0;
+  int opt, i;
+
+  cfg.max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cfg.max_threads < 4) cfg.max_threads = 4;
+  if (cfg.max_threads > MAX_THREADS) cfg.max_threads = MAX_THREADS;
+  cfg.num_ops = NUM_OPS;
+  cfg.window = WINDOW;
+  parse_size_dist("uniform:32:512", &cfg.dist);
+  cfg.format = FORMAT_TEXT;
+
+  while ((opt = getopt_long(argc, argv, "N:n:w:d:P:A:o:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'N':
+      cfg.max_threads = atoi(optarg);
+      if (cfg.max_threads < 1 || cfg.max_threads > MAX_THREADS) usage(argv[0]);
+      break;
+    case 'n':
+      cfg.num_ops = atoi(optarg);
+      if (cfg.num_ops < LARSON_EPOCHS) usage(argv[0]);
+      break;
+    case 'w':
+      cfg.window = atoi(optarg);
+      if (cfg.window < 1) usage(argv[0]);
+      break;
+    case 'd':
+      if (!parse_size_dist(optarg, &cfg.dist)) usage(argv[0]);
+      break;
+    case 'P':
+      snprintf(pattern_list, sizeof(pattern_list), "%s", optarg);
+      break;
+    case 'A':
+      snprintf(alloc_list, sizeof(alloc_list), "%s", optarg);
+      break;
+    case 'o':
+      cfg.format = parse_format(optarg);
+      if (cfg.format < 0) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    } //switch
+  } //while
+
+  char *saveptr;
+  for (char *name = strtok_r(pattern_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    for (i=0; i < PATTERN_COUNT && strcmp(name, pattern_names[i]) != 0; i++);
+    if (i == PATTERN_COUNT || num_patterns == PATTERN_COUNT) usage(argv[0]);
+    patterns[num_patterns++] = i;
+  } //for name
+
+  if (cfg.format == FORMAT_TEXT) {
+    printf("%-10s %-9s %7s %10s %12s %14s %14s %8s\n", "alloc", "pattern", "threads",
+	   "time s", "ops/s", "peak live", "rss growth", "blowup");
+  } else if (cfg.format == FORMAT_CSV) {
+    printf("allocator,pattern,threads,time_s,ops,ops_per_s,peak_live_bytes,rss_growth_bytes,"
+	   "data_segment_bytes,blowup\n");
+  } //else
+  fflush(stdout);
+
+  for (char *name = strtok_r(alloc_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    alloc = find_allocator(name);
+    if (alloc == NULL) usage(argv[0]);
+    for (int p=0; p < num_patterns; p++) {
+      for (num_threads=1; num_threads <= cfg.max_threads; num_threads++) {
+	pid_t pid = fork();
+	if (pid == 0) {
+	  struct result res;
+	  run_pattern(patterns[p], &res);
+	  print_result(patterns[p], &res);
+	  _exit(0);
+	} //if
+	int status;
+	if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	  fprintf(stderr, "%s %s with %d threads failed\n", alloc->name, pattern_names[patterns[p]], num_threads);
+	  return EXIT_FAILURE;
+	} //if
+      } //for num_threads
+    } //for p
+  } //for name
+
+  return 0;
+}
@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "my_malloc.h"
+#include "bench_common.h"
+
+// Replays a trace recorded with TS_TRACE=<file> against one or more
+// allocators. Every traced thread gets a replay thread. In strict mode the
+// threads take turns in the recorded order, in relaxed mode a thread only
+// waits for the objects it frees to exist. Each run forks, so that every
+// run starts with an empty allocator and its peak RSS is its own.
+
+enum { MODE_STRICT, MODE_RELAXED };
+
+struct replay_op {
+  unsigned int op;
+  int thread;
+  long object; // Object created, -1 for none
+  long source; // Object freed or resized, -1 for none
+  size_t size;
+  size_t alignment;
+};
+
+struct replay_thread {
+  pthread_t thread;
+  unsigned int tid;
+  long *ops; // Positions in the replay order
+  long num_ops;
+  long capacity;
+  double alloc_ns;
+  void *segment_peak; // Highest break seen by this thread
+};
+
+struct result {
+  double elapsed_ns;
+  double alloc_ns;
+  unsigned long peak_data_segment;
+  long max_rss;
+};
+
+static struct replay_op *ops;
+static long num_ops;
+static long num_objects;
+static struct replay_thread *threads;
+static int num_threads;
+static void **objects;
+static int *object_ready;
+static int mode = MODE_STRICT;
+static const allocator_t *alloc;
+static long turn;
+static void *segment_start;
+pthread_barrier_t barrier;
+
+static void usage(const char *prog) {
+  fprintf(stderr,
+	  "Usage: %s [options] trace\n"
+	  "  -A, --alloc LIST    comma separated lock,lock-mutex,lock-cpu,nolock,glibc (default %s)\n"
+	  "  -m, --mode M        strict: recorded order, relaxed: only wait for\n"
+	  "                      the objects a thread frees (default strict)\n"
+	  "  -r, --repeat N      runs per allocator (default 1)\n"
+	  "  -o, --format F      text, json or csv (default text)\n",
+	  prog, DEFAULT_ALLOCATOR);
+  exit(EXIT_FAILURE);
+}
+
+
+static TraceEvent *read_trace(const char *path, long *count) {
+  unsigned long magic;
+  FILE *file = fopen(path, "rb");
+  if (file == NULL) {
+    perror(path);
+    return NULL;
+  } //if
+  if (fread(&magic, sizeof(magic), 1, file) != 1 || magic != TRACE_MAGIC) {
+    fprintf(stderr, "%s: not an allocation trace\n", path);
+    fclose(file);
+    return NULL;
+  } //if
+  fseek(file, 0, SEEK_END);
+  long bytes = ftell(file) - sizeof(magic);
+  fseek(file, sizeof(magic), SEEK_SET);
+  *count = bytes / sizeof(TraceEvent);
+  TraceEvent *events = malloc((*count + 1) * sizeof(TraceEvent));
+  if (events == NULL || fread(events, sizeof(TraceEvent), *count, file) != (size_t)*count) {
+    fprintf(stderr, "%s: short read\n", path);
+    free(events);
+    fclose(file);
+    return NULL;
+  } //if
+  fclose(file);
+  return events;
+}
+
+
+// Live objects by address while the trace is resolved, open addressing
+static unsigned long *table_keys;
+static long *table_values;
+static unsigned long table_mask;
+
+#define TABLE_EMPTY 0
+#define TABLE_DELETED 1
+
+static unsigned long table_slot(unsigned long key) {
+  return (key >> 4) * 0x9e3779b97f4a7c15UL;
+}
+
+static void table_put(unsigned long key, long value) {
+  unsigned long i = table_slot(key) & table_mask;
+  while (table_keys[i] != TABLE_EMPTY && table_keys[i] != TABLE_DELETED && table_keys[i] != key) {
+    i = (i + 1) & table_mask;
+  } //while
+  table_keys[i] = key;
+  table_values[i] = value;
+}
+
+// Remove an address and return its object, -1 if it is not live
+static long table_take(unsigned long key) {
+  unsigned long i = table_slot(key) & table_mask;
+  while (table_keys[i] != TABLE_EMPTY) {
+    if (table_keys[i] == key) {
+      table_keys[i] = TABLE_DELETED;
+      return table_values[i];
+    } //if
+    i = (i + 1) & table_mask;
+  } //while
+  return -1;
+}
+
+
+static int compare_seq(const void *a, const void *b) {
+  unsigned long x = *(const unsigned long *)a;
+  unsigned long y = *(const unsigned long *)b;
+  return (x > y) - (x < y);
+}
+
+// A point of the recorded order where an address is bound to an object
+// or released: (seq, event index * 2 + 1 for a release)
+struct point {
+  unsigned long seq;
+  long ref;
+};
+
+static int find_thread(unsigned int tid) {
+  for (int i = 0; i < num_threads; i++) {
+    if (threads[i].tid == tid) return i;
+  } //for i
+  threads = realloc(threads, (num_threads + 1) * sizeof(struct replay_thread));
+  memset(&threads[num_threads], 0, sizeof(struct replay_thread));
+  threads[num_threads].tid = tid;
+  return num_threads++;
+}
+
+// Turn the events into replay operations on dense object numbers. An
+// address is released at the seq of its free, or at the release seq of a
+// realloc, and bound again at the seq of the next allocation returning it.
+static int resolve_trace(TraceEvent *events, long count) {
+  long i;
+  struct point *points = malloc(2 * count * sizeof(struct point));
+  long *sources = malloc(count * sizeof(long));
+  long *targets = malloc(count * sizeof(long));
+  long num_points = 0;
+  if (points == NULL || sources == NULL || targets == NULL) return 0;
+
+  for (i=0; i < count; i++) {
+    TraceEvent *ev = &events[i];
+    sources[i] = targets[i] = -1;
+    if (ev->op == TRACE_FREE) {
+      points[num_points++] = (struct point){ev->seq, 2 * i + 1};
+    } else if (ev->op == TRACE_REALLOC) {
+      if (ev->arg != 0) points[num_points++] = (struct point){ev->releaseSeq, 2 * i + 1};
+      if (ev->object != 0) points[num_points++] = (struct point){ev->seq, 2 * i};
+    } else {
+      points[num_points++] = (struct point){ev->seq, 2 * i};
+    } //else
+  } //for i
+  qsort(points, num_points, sizeof(struct point), compare_seq);
+
+  unsigned long capacity = 16;
+  while (capacity < 2 * (unsigned long)count + 2) capacity *= 2;
+  table_keys = calloc(capacity, sizeof(unsigned long));
+  table_values = malloc(capacity * sizeof(long));
+  table_mask = capacity - 1;
+  if (table_keys == NULL || table_values == NULL) return 0;
+
+  num_objects = 0;
+  for (i=0; i < num_points; i++) {
+    TraceEvent *ev = &events[points[i].ref / 2];
+    if (points[i].ref % 2 == 1) {
+      sources[points[i].ref / 2] = table_take((ev->op == TRACE_FREE) ? ev->object : ev->arg);
+    } else {
+      targets[points[i].ref / 2] = num_objects;
+      table_put(ev->object, num_objects++);
+    } //else
+  } //for i
+
+  // Replay order is the order of the events themselves
+  unsigned long *order = malloc(count * sizeof(unsigned long) * 2);
+  for (i=0; i < count; i++) {
+    order[2 * i] = events[i].seq;
+    order[2 * i + 1] = i;
+  } //for i
+  qsort(order, count, 2 * sizeof(unsigned long), compare_seq);
+
+  ops = malloc((count + 1) * sizeof(struct replay_op));
+  num_ops = 0;
+  for (i=0; i < count; i++) {
+    long e = order[2 * i + 1];
+    TraceEvent *ev = &events[e];
+    // Frees of blocks allocated before tracing started are dropped
+    if (ev->op == TRACE_FREE && sources[e] < 0) continue;
+    struct replay_op *op = &ops[num_ops];
+    op->op = ev->op;
+    op->thread = find_thread(ev->tid);
+    op->object = targets[e];
+    op->source = sources[e];
+    op->size = ev->size;
+    op->alignment = (ev->op == TRACE_ALIGNED) ? ev->arg : 0;
+    struct replay_thread *t = &threads[op->thread];
+    if (t->num_ops == t->capacity) {
+      t->capacity = t->capacity ? 2 * t->capacity : 1024;
+      t->ops = realloc(t->ops, t->capacity * sizeof(long));
+    } //if
+    t->ops[t->num_ops++] = num_ops++;
+  } //for i
+
+  free(order);
+  free(points);
+  free(sources);
+  free(targets);
+  free(table_keys);
+  free(table_values);
+  return 1;
+}
+
+
+static void wait_for(long *value, long target) {
+  while (__atomic_load_n(value, __ATOMIC_ACQUIRE) != target) {
+    sched_yield();
+  } //while
+}
+
+static void wait_ready(long object) {
+  while (!__atomic_load_n(&object_ready[object], __ATOMIC_ACQUIRE)) {
+    sched_yield();
+  } //while
+}
+
+static void run_op(struct replay_op *op) {
+  void *old = (op->source >= 0) ? objects[op->source] : NULL;
+  void *res = NULL;
+  if (op->op == TRACE_MALLOC) {
+    res = alloc->malloc_fn(op->size);
+  } else if (op->op == TRACE_ALIGNED) {
+    res = alloc->aligned_fn(op->alignment, op->size);
+  } else if (op->op == TRACE_REALLOC) {
+    res = alloc->realloc_fn(old, op->size);
+  } else {
+    alloc->free_fn(old);
+  } //else
+  if (op->object >= 0) {
+    objects[op->object] = res;
+  } //if
+}
+
+static void *replay(void *arg) {
+  struct replay_thread *t = arg;
+  double alloc_ns = 0;
+  void *segment_peak = segment_start;
+  pthread_barrier_wait(&barrier);
+  for (long i=0; i < t->num_ops; i++) {
+    long pos = t->ops[i];
+    struct replay_op *op = &ops[pos];
+    if (mode == MODE_STRICT) {
+      wait_for(&turn, pos);
+    } else if (op->source >= 0) {
+      wait_ready(op->source);
+    } //else
+    double start = now_ns();
+    run_op(op);
+    alloc_ns += now_ns() - start;
+    if (mode == MODE_STRICT) {
+      __atomic_store_n(&turn, pos + 1, __ATOMIC_RELEASE);
+    } else if (op->object >= 0) {
+      __atomic_store_n(&object_ready[op->object], 1, __ATOMIC_RELEASE);
+    } //else
+    // Sampled outside the timed call, so the syscall is not allocator time
+    void *brk = sbrk(0);
+    if (brk > segment_peak) segment_peak = brk;
+  } //for i
+  t->alloc_ns = alloc_ns;
+  t->segment_peak = segment_peak;
+  return NULL;
+}
+
+static void run_once(struct result *res) {
+  struct timespec start_time, end_time;
+  long i;
+
+  memset(objects, 0, num_objects * sizeof(void *));
+  memset(object_ready, 0, num_objects * sizeof(int));
+  turn = 0;
+  segment_start = sbrk(0);
+  pthread_barrier_init(&barrier, NULL, num_threads + 1);
+  for (i=0; i < num_threads; i++) {
+    pthread_create(&threads[i].thread, NULL, replay, &threads[i]);
+  } //for i
+  //The threads wait for us, so starting the clock first leaves none of their work out
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+  pthread_barrier_wait(&barrier);
+  for (i=0; i < num_threads; i++) {
+    pthread_join(threads[i].thread, NULL);
+  } //for i
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  pthread_barrier_destroy(&barrier);
+
+  res->elapsed_ns = calc_time(start_time, end_time);
+  res->alloc_ns = 0;
+  void *segment_peak = segment_start;
+  for (i=0; i < num_threads; i++) {
+    res->alloc_ns += threads[i].alloc_ns;
+    if (threads[i].segment_peak > segment_peak) segment_peak = threads[i].segment_peak;
+  } //for i
+  res->peak_data_segment = (unsigned long)(segment_peak - segment_start);
+  res->max_rss = peak_rss();
+  // The kernel updates the high-water mark lazily
+  long rss = current_rss();
+  if (rss > res->max_rss) res->max_rss = rss;
+
+  // Objects still live at the end of the trace
+  char *freed = calloc(num_objects, 1);
+  for (i=0; i < num_ops; i++) {
+    if (ops[i].source >= 0) freed[ops[i].source] = 1;
+  } //for i
+  for (i=0; i < num_objects; i++) {
+    if (!freed[i]) alloc->free_fn(objects[i]);
+  } //for i
+  free(freed);
+}
+
+
+static void print_result(const struct result *res, int run, int format) {
+  if (format == FORMAT_TEXT) {
+    printf("Replayed %ld operations of %d threads with %s\n", num_ops, num_threads, alloc->name);
+    printf("Execution Time = %f seconds\n", res->elapsed_ns / 1e9);
+    printf("Allocator Time = %f seconds\n", res->alloc_ns / 1e9);
+    printf("Peak Data Segment Size = %lu bytes\n", res->peak_data_segment);
+    printf("Max RSS = %ld bytes\n", res->max_rss);
+  } else if (format == FORMAT_JSON) {
+    printf("{\"allocator\": \"%s\", \"run\": %d, \"mode\": \"%s\", \"threads\": %d, \"ops\": %ld, "
+	   "\"time_s\": %f, \"alloc_time_s\": %f, \"peak_data_segment_bytes\": %lu, \"max_rss_bytes\": %ld}\n",
+	   alloc->name, run, (mode == MODE_STRICT) ? "strict" : "relaxed", num_threads, num_ops,
+	   res->elapsed_ns / 1e9, res->alloc_ns / 1e9, res->peak_data_segment, res->max_rss);
+  } else {
+    printf("%s,%d,%s,%d,%ld,%f,%f,%lu,%ld\n",
+	   alloc->name, run, (mode == MODE_STRICT) ? "strict" : "relaxed", num_threads, num_ops,
+	   res->elapsed_ns / 1e9, res->alloc_ns / 1e9, res->peak_data_segment, res->max_rss);
+  } //else
+}
+
+
+int main(int argc, char *argv[])
+{
+  static const struct option options[] = {
+    {"alloc", required_argument, NULL, 'A'},
+    {"mode", required_argument, NULL, 'm'},
+    {"repeat", required_argument, NULL, 'r'},
+    {"format", required_argument, NULL, 'o'},
+    {NULL, 0, NULL, 0}
+  };
+  char alloc_list[256] = DEFAULT_ALLOCATOR;
+  int opt, i, repeat = 1, format = FORMAT_TEXT;
+  long count;
+
+  while ((opt = getopt_long(argc, argv, "A:m:r:o:", options, NULL)) != -1) {
+    switch (opt) {
+    case 'A':
+      snprintf(alloc_list, sizeof(alloc_list), "%s", optarg);
+      break;
+    case 'm':
+      if (strcmp(optarg, "strict") == 0) mode = MODE_STRICT;
+      else if (strcmp(optarg, "relaxed") == 0) mode = MODE_RELAXED;
+      else usage(argv[0]);
+      break;
+    case 'r':
+      repeat = atoi(optarg);
+      if (repeat < 1) usage(argv[0]);
+      break;
+    case 'o':
+      format = parse_format(optarg);
+      if (format < 0) usage(argv[0]);
+      break;
+    default:
+      usage(argv[0]);
+    } //switch
+  } //while
+  if (optind != argc - 1) usage(argv[0]);
+
+  TraceEvent *events = read_trace(argv[optind], &count);
+  if (events == NULL || !resolve_trace(events, count)) {
+    return EXIT_FAILURE;
+  } //if
+  free(events);
+  objects = malloc((num_objects + 1) * sizeof(void *));
+  object_ready = malloc((num_objects + 1) * sizeof(int));
+
+  if (format == FORMAT_CSV) {
+    printf("allocator,run,mode,threads,ops,time_s,alloc_time_s,peak_data_segment_bytes,max_rss_bytes\n");
+  } //if
+  fflush(stdout);
+
+  char *saveptr;
+  for (char *name = strtok_r(alloc_list, ",", &saveptr); name != NULL; name = strtok_r(NULL, ",", &saveptr)) {
+    alloc = find_allocator(name);
+    if (alloc == NULL) usage(argv[0]);
+    for (i=0; i < repeat; i++) {
+      pid_t pid = fork();
+      if (pid == 0) {
+	struct result res;
+	run_once(&res);
+	print_result(&res, i, format);
+	fflush(stdout);
+	_exit(0);
+      } //if
+      int status;
+      if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	fprintf(stderr, "%s run %d failed\n", alloc->name, i);
+	return EXIT_FAILURE;
+      } //if
+    } //for i
+  } //for name
+
+  return 0;
+}
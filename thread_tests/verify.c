@@ -0,0 +1,208 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "verify.h"
+
+#define FILL_MIX 0x9e3779b97f4a7c15UL
+
+static uint64_t fill_word(unsigned long seed, size_t word) {
+  return (seed * FILL_MIX) ^ (word * 0xbf58476d1ce4e5b9UL);
+}
+
+void verify_fill(void *ptr, size_t bytes, unsigned long seed) {
+  size_t words = bytes / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    uint64_t word = fill_word(seed, i);
+    memcpy((char *)ptr + i * sizeof(uint64_t), &word, sizeof(word));
+  }
+  uint64_t tail = fill_word(seed, words);
+  memcpy((char *)ptr + words * sizeof(uint64_t), &tail, bytes % sizeof(uint64_t));
+}
+
+int verify_check_fill(const void *ptr, size_t bytes, unsigned long seed) {
+  size_t words = bytes / sizeof(uint64_t);
+  for (size_t i = 0; i < words; i++) {
+    uint64_t word;
+    memcpy(&word, (const char *)ptr + i * sizeof(uint64_t), sizeof(word));
+    if (word != fill_word(seed, i)) {
+      return 0;
+    }
+  }
+  uint64_t tail = fill_word(seed, words);
+  return memcmp((const char *)ptr + words * sizeof(uint64_t), &tail, bytes % sizeof(uint64_t)) == 0;
+}
+
+
+static int compare_start(const void *a, const void *b) {
+  const char *x = ((const verify_region_t *)a)->start;
+  const char *y = ((const verify_region_t *)b)->start;
+  return (x > y) - (x < y);
+}
+
+// One chunk to sort, or two neighbouring sorted chunks to merge into out
+struct sort_job {
+  pthread_t thread;
+  verify_region_t *base;
+  size_t count;
+  size_t split;
+  verify_region_t *out;
+};
+
+static void *sort_chunk(void *arg) {
+  struct sort_job *job = arg;
+  qsort(job->base, job->count, sizeof(verify_region_t), compare_start);
+  return NULL;
+}
+
+static void *merge_chunks(void *arg) {
+  struct sort_job *job = arg;
+  size_t i = 0, j = job->split, k = 0;
+  while (i < job->split && j < job->count) {
+    job->out[k++] = (job->base[j].start < job->base[i].start) ? job->base[j++] : job->base[i++];
+  }
+  while (i < job->split) job->out[k++] = job->base[i++];
+  while (j < job->count) job->out[k++] = job->base[j++];
+  return NULL;
+}
+
+// Sort chunks in parallel, then merge neighbouring chunks pairwise, half
+// as many threads every round
+static void sort_regions(verify_region_t *regions, size_t count, int threads) {
+  if (threads <= 1 || count < 65536) {
+    qsort(regions, count, sizeof(verify_region_t), compare_start);
+    return;
+  }
+  size_t *bounds = malloc((threads + 1) * sizeof(size_t));
+  struct sort_job *jobs = calloc(threads, sizeof(struct sort_job));
+  verify_region_t *tmp = malloc(count * sizeof(verify_region_t));
+  verify_region_t *src = regions, *dst = tmp;
+  int chunks = threads, i;
+
+  for (i = 0; i <= chunks; i++) {
+    bounds[i] = count * i / chunks;
+  }
+  for (i = 0; i < chunks; i++) {
+    jobs[i].base = regions + bounds[i];
+    jobs[i].count = bounds[i + 1] - bounds[i];
+    pthread_create(&jobs[i].thread, NULL, sort_chunk, &jobs[i]);
+  }
+  for (i = 0; i < chunks; i++) {
+    pthread_join(jobs[i].thread, NULL);
+  }
+
+  while (chunks > 1) {
+    int pairs = chunks / 2;
+    for (i = 0; i < pairs; i++) {
+      jobs[i].base = src + bounds[2 * i];
+      jobs[i].count = bounds[2 * i + 2] - bounds[2 * i];
+      jobs[i].split = bounds[2 * i + 1] - bounds[2 * i];
+      jobs[i].out = dst + bounds[2 * i];
+      pthread_create(&jobs[i].thread, NULL, merge_chunks, &jobs[i]);
+    }
+    if (chunks % 2 == 1) {
+      // The odd chunk out is carried over as it is
+      memcpy(dst + bounds[chunks - 1], src + bounds[chunks - 1], (count - bounds[chunks - 1]) * sizeof(verify_region_t));
+    }
+    for (i = 0; i < pairs; i++) {
+      pthread_join(jobs[i].thread, NULL);
+    }
+    for (i = 0; i < pairs; i++) {
+      bounds[i] = bounds[2 * i];
+    }
+    if (chunks % 2 == 1) {
+      bounds[pairs] = bounds[chunks - 1];
+    }
+    chunks = (chunks + 1) / 2;
+    bounds[chunks] = count;
+    verify_region_t *swap = src;
+    src = dst;
+    dst = swap;
+  }
+  if (src != regions) {
+    memcpy(regions, src, count * sizeof(verify_region_t));
+  }
+  free(tmp);
+  free(jobs);
+  free(bounds);
+}
+
+
+struct fill_job {
+  pthread_t thread;
+  verify_region_t *regions;
+  size_t count;
+  long bad; // Position of the first damaged block, -1 for none
+  size_t offset; // First damaged byte in it
+};
+
+static void *check_fills(void *arg) {
+  struct fill_job *job = arg;
+  job->bad = -1;
+  for (size_t i = 0; i < job->count; i++) {
+    verify_region_t *r = &job->regions[i];
+    if (r->seed != 0 && !verify_check_fill(r->start, r->bytes, r->seed)) {
+      // Find the byte for the report, a slow path taken at most once
+      char expected[sizeof(uint64_t)];
+      size_t offset = 0;
+      for (; offset < r->bytes; offset++) {
+        uint64_t word = fill_word(r->seed, offset / sizeof(uint64_t));
+        memcpy(expected, &word, sizeof(word));
+        if (r->start[offset] != expected[offset % sizeof(uint64_t)]) break;
+      }
+      job->bad = i;
+      job->offset = offset;
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+int verify_regions(verify_region_t *regions, size_t count, int threads) {
+  size_t i;
+  if (threads < 1) {
+    threads = 1;
+  }
+  sort_regions(regions, count, threads);
+
+  // Sorted by start, a region overlaps an earlier one exactly when it
+  // starts before the furthest end seen so far
+  size_t furthest = 0;
+  for (i = 1; i < count; i++) {
+    verify_region_t *prev = &regions[furthest];
+    if (regions[i].start < prev->start + prev->bytes) {
+      printf("Found 2 overlapping allocated regions.\n");
+      printf("Region 1 bounds: start=%p, end=%p, size=%zdB, idx=%ld\n", prev->start, prev->start + prev->bytes, prev->bytes, prev->index);
+      printf("Region 2 bounds: start=%p, end=%p, size=%zdB, idx=%ld\n", regions[i].start, regions[i].start + regions[i].bytes, regions[i].bytes, regions[i].index);
+      return 0;
+    }
+    if (regions[i].start + regions[i].bytes > prev->start + prev->bytes) {
+      furthest = i;
+    }
+  }
+
+  struct fill_job *jobs = calloc(threads, sizeof(struct fill_job));
+  int ok = 1;
+  for (int t = 0; t < threads; t++) {
+    jobs[t].regions = regions + count * t / threads;
+    jobs[t].count = count * (t + 1) / threads - count * t / threads;
+    if (threads > 1) {
+      pthread_create(&jobs[t].thread, NULL, check_fills, &jobs[t]);
+    } else {
+      check_fills(&jobs[t]);
+    }
+  }
+  for (int t = 0; t < threads; t++) {
+    if (threads > 1) {
+      pthread_join(jobs[t].thread, NULL);
+    }
+    if (ok && jobs[t].bad >= 0) {
+      verify_region_t *r = &jobs[t].regions[jobs[t].bad];
+      printf("Allocated region was overwritten: start=%p, size=%zdB, idx=%ld, byte %zd\n", r->start, r->bytes, r->index, jobs[t].offset);
+      ok = 0;
+    }
+  }
+  free(jobs);
+  return ok;
+}
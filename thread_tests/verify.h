@@ -0,0 +1,25 @@
+#ifndef VERIFY_H
+#define VERIFY_H
+#include <stddef.h>
+
+// Correctness checks shared by the tests in this directory
+
+// A block that is allocated at the time of the check
+typedef struct verify_region {
+  char *start;
+  size_t bytes;
+  long index; // Position in the test's own table, for the report
+  unsigned long seed; // Fill pattern of the block, 0 if it was not filled
+} verify_region_t;
+
+// Scribble a pattern derived from seed over a block, and check that it is
+// still there. verify_check_fill() returns 1 if the block is intact.
+void verify_fill(void *ptr, size_t bytes, unsigned long seed);
+int verify_check_fill(const void *ptr, size_t bytes, unsigned long seed);
+
+// Sort the regions by address with up to threads threads and check that
+// no two overlap, then that every filled block still holds its pattern.
+// Prints the first problem found and returns 0, or returns 1.
+int verify_regions(verify_region_t *regions, size_t count, int threads);
+
+#endif